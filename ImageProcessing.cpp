@@ -1,640 +1,14 @@
-#include <algorithm>
-#include <cmath>
+#include "ImageProcessing.hpp"
+
+#include <chrono>
+#include <cstring>
 #include <fstream>
-#include <iostream>
+#include <linux/perf_event.h>
 #include <sstream>
-#include <string>
-#include <vector>
-class GSCImage;
-
-/******************** PIXEL CLASS ********************/
-class Pixel {
-public:
-  virtual ~Pixel() = default;
-};
-/******************** END PIXEL CLASS ********************/
-
-/******************** GSCPIXEL CLASS ********************/
-class GSCPixel : public Pixel {
-private:
-  unsigned char value_;
-
-public:
-  GSCPixel() = default;
-  GSCPixel(const GSCPixel &p) : value_(p.value_) {}
-  GSCPixel(unsigned char value) : value_(value) {}
-
-  unsigned char getValue() { return value_; }
-
-  void setValue(unsigned char value) { value_ = value; }
-};
-/******************** END GSCIMAGE CLASS ********************/
-
-/******************** RGBPIXEL CLASS ********************/
-class RGBPixel : public Pixel {
-private:
-  unsigned char red_;
-  unsigned char green_;
-  unsigned char blue_;
-
-public:
-  RGBPixel() = default;
-  RGBPixel(const RGBPixel &p)
-      : red_(p.red_), green_(p.green_), blue_(p.blue_) {}
-  RGBPixel(unsigned char r, unsigned char g, unsigned char b)
-      : red_(r), green_(g), blue_(b) {}
-
-  unsigned char getRed() const { return red_; }
-
-  unsigned char getGreen() const { return green_; }
-
-  unsigned char getBlue() const { return blue_; }
-
-  void setRed(unsigned char r) { red_ = r; }
-
-  void setGreen(unsigned char g) { green_ = g; }
-
-  void setBlue(unsigned char b) { blue_ = b; }
-};
-/******************** END RGBPIXEL CLASS********************/
-
-/******************** IMAGE CLASS ********************/
-class Image {
-protected:
-  int width;
-  int height;
-  int max_luminocity;
-
-public:
-  int getWidth() const { return width; }
-  int getHeight() const { return height; }
-  int getMaxLuminocity() const { return max_luminocity; }
-  void setWidth(int width) { this->width = width; }
-  void setHeight(int height) { this->height = height; }
-  void setMaxLuminocity(int lum) { this->max_luminocity = lum; }
-
-  virtual Pixel &getPixel(int row, int col) const = 0;
-  virtual Image &operator+=(int times) = 0;
-  virtual Image &operator*=(double factor) = 0;
-  virtual Image &operator!() = 0;
-  virtual Image &operator~() = 0;
-  virtual Image &operator*() = 0;
-  friend std::ostream &operator<<(std::ostream &out, Image &image);
-  virtual ~Image() = default;
-};
-/******************** END IMAGE CLASS ********************/
-
-/******************** RGBImage CLASS ********************/
-class RGBImage : public Image {
-private:
-  RGBPixel **pixels;
-
-public:
-  RGBImage() : pixels(nullptr) {
-    // Initialize the class fields
-    width = 0;
-    height = 0;
-    max_luminocity = 255;
-    pixels = nullptr;
-  }
-
-  RGBImage(const RGBImage &img) : pixels(nullptr) {
-    width = img.getWidth();
-    height = img.getHeight();
-    max_luminocity = img.getMaxLuminocity();
-
-    // Allocate memory for pixels
-    pixels = new RGBPixel *[height];
-    for (int row = 0; row < height; row++) {
-      pixels[row] = new RGBPixel[width];
-      for (int col = 0; col < width; col++) {
-        pixels[row][col] = img.pixels[row][col];
-      }
-    }
-  }
-  RGBImage(const GSCImage &gsc);
-
-  RGBImage(int Width, int Height) : pixels(nullptr) {
-    width = Width;
-    height = Height;
-    max_luminocity = 255;
-
-    // Allocate memory for pixels
-    pixels = new RGBPixel *[height];
-    for (int row = 0; row < height; row++) {
-      pixels[row] = new RGBPixel[width];
-      for (int col = 0; col < width; col++) {
-        pixels[row][col] = RGBPixel();
-      }
-    }
-  }
-
-  RGBImage(std::istream &stream) : pixels(nullptr) {
-    stream >> width >> height >> max_luminocity;
-
-    // Allocate memory for pixels
-    pixels = new RGBPixel *[height];
-    for (int row = 0; row < height; row++) {
-      pixels[row] = new RGBPixel[width];
-      for (int col = 0; col < width; col++) {
-        int red, green, blue;
-        stream >> red >> green >> blue;
-        pixels[row][col] = RGBPixel(static_cast<unsigned char>(red),
-                                    static_cast<unsigned char>(green),
-                                    static_cast<unsigned char>(blue));
-      }
-    }
-  }
-
-  virtual RGBPixel &getPixel(int row, int col) const override {
-    if (pixels == nullptr) {
-      throw std::runtime_error("Image is not initialized.");
-    }
-
-    if (row < 0 || row >= height || col < 0 || col >= width) {
-      throw std::out_of_range("Invalid pixel coordinates.");
-    }
-
-    return pixels[row][col];
-  }
-
-  RGBImage &operator=(const RGBImage &img) {
-    if (this == &img) {
-      // Self-assignment check
-      return *this;
-    }
-
-    // Free existing memory
-    if (pixels != nullptr) {
-      for (int row = 0; row < height; row++) {
-        delete[] pixels[row];
-      }
-      delete[] pixels;
-      pixels = nullptr;
-    }
-
-    // Assign new dimensions and maximum luminosity
-    width = img.width;
-    height = img.height;
-    max_luminocity = img.max_luminocity;
-
-    // Allocate new memory and copy pixels
-    pixels = new RGBPixel *[height];
-    for (int row = 0; row < height; row++) {
-      pixels[row] = new RGBPixel[width];
-      for (int col = 0; col < width; col++) {
-        pixels[row][col] = img.getPixel(row, col);
-      }
-    }
-
-    return *this;
-  }
-
-  virtual Image &operator+=(int times) override {
-    // Calculate the effective rotation times
-    int effectiveTimes = times % 4;
-    if (effectiveTimes < 0)
-      effectiveTimes += 4;
-
-    // Rotate the image clockwise
-    for (int i = 0; i < effectiveTimes; i++) {
-      // Create a temporary image to store the rotated pixels
-      RGBImage rotatedImage;
-      rotatedImage.setWidth(getHeight());
-      rotatedImage.setHeight(getWidth());
-      rotatedImage.setMaxLuminocity(255);
-      rotatedImage.pixels = new RGBPixel *[rotatedImage.getHeight()];
-      for (int row = 0; row < rotatedImage.getHeight(); row++) {
-        rotatedImage.pixels[row] = new RGBPixel[rotatedImage.getWidth()];
-        for (int col = 0; col < rotatedImage.getWidth(); col++) {
-          rotatedImage.pixels[row][col] = RGBPixel();
-        }
-      }
-
-      // Perform the rotation by rearranging the pixels
-      for (int row = 0; row < getHeight(); row++) {
-        for (int col = 0; col < getWidth(); col++) {
-          // Get the pixel from the original image
-          RGBPixel &originalPixel = getPixel(row, col);
-
-          // Calculate the new coordinates for the rotated pixel
-          int rotatedRow = col;
-          int rotatedCol = getHeight() - 1 - row;
-
-          // Get the pixel from the rotated image and assign theoriginal pixel
-          // value
-          RGBPixel &rotatedPixel =
-              rotatedImage.getPixel(rotatedRow, rotatedCol);
-          rotatedPixel = originalPixel;
-        }
-      }
-
-      // Assign the rotated image to the current image
-      *this = rotatedImage;
-      if (rotatedImage.pixels != nullptr) {
-        for (int row = 0; row < rotatedImage.getHeight(); row++) {
-          delete[] rotatedImage.pixels[row];
-        }
-        delete[] rotatedImage.pixels;
-        rotatedImage.pixels = nullptr;
-      }
-    }
-
-    return *this;
-  }
-
-  virtual Image &operator*=(double factor) override {
-    // Calculate the new dimensions based on the factor
-    int newWidth = static_cast<int>(getWidth() * factor);
-    int newHeight = static_cast<int>(getHeight() * factor);
-
-    // Create a temporary image with the new dimensions
-    RGBImage resizedImage;
-    resizedImage.setWidth(newWidth);
-    resizedImage.setHeight(newHeight);
-    resizedImage.setMaxLuminocity(255);
-    resizedImage.pixels = new RGBPixel *[resizedImage.getHeight()];
-    for (int row = 0; row < resizedImage.getHeight(); row++) {
-      resizedImage.pixels[row] = new RGBPixel[resizedImage.getWidth()];
-      for (int col = 0; col < resizedImage.getWidth(); col++) {
-        resizedImage.pixels[row][col] = RGBPixel();
-      }
-    }
-
-    // Scale the pixels from the original image to the resized image
-    for (int row = 0; row < newHeight; row++) {
-      for (int col = 0; col < newWidth; col++) {
-        // Calculate the corresponding coordinates in the original image
-        int r1 = std::min(static_cast<int>(std::floor(row / factor)),
-                          getHeight() - 1);
-        int r2 = std::min(static_cast<int>(std::ceil(row / factor)),
-                          getHeight() - 1);
-        int c1 = std::min(static_cast<int>(std::floor(col / factor)),
-                          getWidth() - 1);
-        int c2 =
-            std::min(static_cast<int>(std::ceil(col / factor)), getWidth() - 1);
-
-        // Get the pixels from the original image
-        RGBPixel &p11 = getPixel(r1, c1);
-        RGBPixel &p12 = getPixel(r1, c2);
-        RGBPixel &p21 = getPixel(r2, c1);
-        RGBPixel &p22 = getPixel(r2, c2);
-
-        // Calculate the average brightness
-        unsigned char avgRedBrightness =
-            (p11.getRed() + p12.getRed() + p21.getRed() + p22.getRed()) / 4;
-        unsigned char avgGreenBrightness = (p11.getGreen() + p12.getGreen() +
-                                            p21.getGreen() + p22.getGreen()) /
-                                           4;
-        unsigned char avgBlueBrightness =
-            (p11.getBlue() + p12.getBlue() + p21.getBlue() + p22.getBlue()) / 4;
-
-        // Set the new pixel in the resized image
-        resizedImage.getPixel(row, col).setRed(avgRedBrightness);
-        resizedImage.getPixel(row, col).setGreen(avgGreenBrightness);
-        resizedImage.getPixel(row, col).setBlue(avgBlueBrightness);
-      }
-    }
-
-    // Assign the resized image to the current image
-    *this = resizedImage;
-    if (resizedImage.pixels != nullptr) {
-      for (int row = 0; row < resizedImage.getHeight(); row++) {
-        delete[] resizedImage.pixels[row];
-      }
-      delete[] resizedImage.pixels;
-      resizedImage.pixels = nullptr;
-    }
-    return *this;
-  }
-
-  virtual Image &operator!() override {
-    if (pixels == nullptr) {
-      // Image is empty, nothing to invert
-      return *this;
-    }
-
-    for (int row = 0; row < height; row++) {
-      for (int col = 0; col < width; col++) {
-        RGBPixel &pixel = getPixel(row, col);
-        unsigned char red = pixel.getRed();
-        unsigned char green = pixel.getGreen();
-        unsigned char blue = pixel.getBlue();
-
-        unsigned char invertedRed = max_luminocity - red;
-        unsigned char invertedGreen = max_luminocity - green;
-        unsigned char invertedBlue = max_luminocity - blue;
-
-        pixel.setRed(invertedRed);
-        pixel.setGreen(invertedGreen);
-        pixel.setBlue(invertedBlue);
-      }
-    }
-
-    return *this;
-  }
-
-  virtual Image &operator~() override;
-
-  virtual Image &operator*() override {
-    if (pixels == nullptr) {
-      // Image is empty, nothing to reverse
-      return *this;
-    }
-
-    for (int row = 0; row < height; row++) {
-      for (int col = 0; col < width / 2; col++) {
-        std::swap(pixels[row][col], pixels[row][width - 1 - col]);
-      }
-    }
-
-    return *this;
-  }
-
-  friend std::ostream &operator<<(std::ostream &out, Image &image);
-
-  ~RGBImage() {
-    // Free the memory allocated for the pixels
-    if (pixels != nullptr) {
-      for (int row = 0; row < height; row++) {
-        delete[] pixels[row];
-        pixels[row] = nullptr; // Set the row pointer to nullptr
-      }
-      delete[] pixels;
-      pixels = nullptr;
-    }
-  }
-};
-/******************** END RGBIMAGE CLASS********************/
-
-/******************** GSCImage CLASS ********************/
-class GSCImage : public Image {
-private:
-  GSCPixel **pixels;
-
-public:
-  GSCImage() : pixels(nullptr) {
-    // Initialize the class fields
-    width = 0;
-    height = 0;
-    max_luminocity = 255;
-    pixels = nullptr;
-  }
-
-  GSCImage(const GSCImage &img) : pixels(nullptr) {
-    width = img.getWidth();
-    height = img.getHeight();
-    max_luminocity = img.getMaxLuminocity();
-
-    // Allocate memory for pixels
-    pixels = new GSCPixel *[height];
-    for (int row = 0; row < height; row++) {
-      pixels[row] = new GSCPixel[width];
-      for (int col = 0; col < width; col++) {
-        pixels[row][col] = img.pixels[row][col];
-      }
-    }
-  }
-
-  GSCImage(const RGBImage &rgb) : pixels(nullptr) {
-    width = rgb.getWidth();
-    height = rgb.getHeight();
-    max_luminocity = rgb.getMaxLuminocity();
-
-    // Allocate memory for pixels
-    pixels = new GSCPixel *[height];
-    for (int row = 0; row < height; row++) {
-      pixels[row] = new GSCPixel[width];
-      for (int col = 0; col < width; col++) {
-        const RGBPixel &rgbPixel = rgb.getPixel(row, col);
-        unsigned char grayValue = static_cast<unsigned char>(
-            rgbPixel.getRed() * 0.3 + rgbPixel.getGreen() * 0.59 +
-            rgbPixel.getBlue() * 0.11);
-        pixels[row][col] = GSCPixel(grayValue);
-      }
-    }
-  }
-
-  GSCImage(std::istream &stream) : pixels(nullptr) {
-    stream >> width >> height >> max_luminocity;
-
-    // Allocate memory for pixels
-    pixels = new GSCPixel *[height];
-    for (int row = 0; row < height; row++) {
-      pixels[row] = new GSCPixel[width];
-      for (int col = 0; col < width; col++) {
-        int pixelValue;
-        stream >> pixelValue;
-        pixels[row][col] = GSCPixel(static_cast<unsigned char>(pixelValue));
-      }
-    }
-  }
-
-  virtual GSCPixel &getPixel(int row, int col) const override {
-    if (pixels == nullptr) {
-      throw std::runtime_error("Image is not initialized.");
-    }
-
-    if (row < 0 || row >= height || col < 0 || col >= width) {
-      throw std::out_of_range("Invalid pixel coordinates.");
-    }
-
-    return pixels[row][col];
-  }
-
-  virtual Image &operator+=(int times) override {
-    // Calculate the effective rotation times
-    int effectiveTimes = times % 4;
-    if (effectiveTimes < 0)
-      effectiveTimes += 4;
-
-    // Rotate the image clockwise
-    for (int i = 0; i < effectiveTimes; i++) {
-      // Create a temporary image to store the rotated pixels
-      GSCImage rotatedImage;
-      rotatedImage.setWidth(getHeight());
-      rotatedImage.setHeight(getWidth());
-      rotatedImage.setMaxLuminocity(255);
-      rotatedImage.pixels = new GSCPixel *[rotatedImage.getHeight()];
-      for (int row = 0; row < rotatedImage.getHeight(); row++) {
-        rotatedImage.pixels[row] = new GSCPixel[rotatedImage.getWidth()];
-        for (int col = 0; col < rotatedImage.getWidth(); col++) {
-          rotatedImage.pixels[row][col] = GSCPixel();
-        }
-      }
-
-      // Perform the rotation by rearranging the pixels
-      for (int row = 0; row < getHeight(); row++) {
-        for (int col = 0; col < getWidth(); col++) {
-          // Get the pixel from the original image
-          GSCPixel &originalPixel = getPixel(row, col);
-
-          // Calculate the new coordinates for the rotated pixel
-          int rotatedRow = col;
-          int rotatedCol = getHeight() - 1 - row;
-
-          // Get the pixel from the rotated image and assign theoriginal pixel
-          // value
-          GSCPixel &rotatedPixel =
-              rotatedImage.getPixel(rotatedRow, rotatedCol);
-          rotatedPixel = originalPixel;
-        }
-      }
-
-      // Assign the rotated image to the current image
-      *this = rotatedImage;
-      if (rotatedImage.pixels != nullptr) {
-        for (int row = 0; row < rotatedImage.getHeight(); row++) {
-          delete[] rotatedImage.pixels[row];
-        }
-        delete[] rotatedImage.pixels;
-        rotatedImage.pixels = nullptr;
-      }
-    }
-
-    return *this;
-  }
-
-  virtual Image &operator*=(double factor) override {
-    // Calculate the new dimensions based on the factor
-    int newWidth = static_cast<int>(getWidth() * factor);
-    int newHeight = static_cast<int>(getHeight() * factor);
-
-    // Create a temporary image with the new dimensions
-    GSCImage resizedImage;
-    resizedImage.setWidth(newWidth);
-    resizedImage.setHeight(newHeight);
-    resizedImage.setMaxLuminocity(255);
-    resizedImage.pixels = new GSCPixel *[resizedImage.getHeight()];
-    for (int row = 0; row < resizedImage.getHeight(); row++) {
-      resizedImage.pixels[row] = new GSCPixel[resizedImage.getWidth()];
-      for (int col = 0; col < resizedImage.getWidth(); col++) {
-        resizedImage.pixels[row][col] = GSCPixel();
-      }
-    }
-
-    // Scale the pixels from the original image to the resized image
-    for (int row = 0; row < newHeight; row++) {
-      for (int col = 0; col < newWidth; col++) {
-        // Calculate the corresponding coordinates in the original image
-        int r1 = std::min(static_cast<int>(std::floor(row / factor)),
-                          getHeight() - 1);
-        int r2 = std::min(static_cast<int>(std::ceil(row / factor)),
-                          getHeight() - 1);
-        int c1 = std::min(static_cast<int>(std::floor(col / factor)),
-                          getWidth() - 1);
-        int c2 =
-            std::min(static_cast<int>(std::ceil(col / factor)), getWidth() - 1);
-
-        // Get the pixels from the original image
-        GSCPixel &p11 = getPixel(r1, c1);
-        GSCPixel &p12 = getPixel(r1, c2);
-        GSCPixel &p21 = getPixel(r2, c1);
-        GSCPixel &p22 = getPixel(r2, c2);
-
-        // Calculate the average brightness
-        unsigned char avgBrightness = (p11.getValue() + p12.getValue() +
-                                       p21.getValue() + p22.getValue()) /
-                                      4;
-
-        // Set the new pixel in the resized image
-        GSCPixel &resizedPixel = resizedImage.getPixel(row, col);
-        resizedPixel.setValue(avgBrightness);
-      }
-    }
-
-    // Assign the resized image to the current image
-    *this = resizedImage;
-    if (resizedImage.pixels != nullptr) {
-      for (int row = 0; row < resizedImage.getHeight(); row++) {
-        delete[] resizedImage.pixels[row];
-      }
-      delete[] resizedImage.pixels;
-      resizedImage.pixels = nullptr;
-    }
-    return *this;
-  }
-
-  virtual Image &operator!() override {
-    if (pixels == nullptr) {
-      // Image is empty, nothing to invert
-      return *this;
-    }
+#include <sys/syscall.h>
+#include <unistd.h>
 
-    for (int row = 0; row < height; row++) {
-      for (int col = 0; col < width; col++) {
-        GSCPixel &pixel = getPixel(row, col);
-        unsigned char currentLuminosity = pixel.getValue();
-        unsigned char invertedLuminosity = max_luminocity - currentLuminosity;
-        pixel.setValue(invertedLuminosity);
-      }
-    }
-
-    return *this;
-  }
-
-  virtual Image &operator*() override {
-    if (pixels == nullptr) {
-      // Image is empty, nothing to reverse
-      return *this;
-    }
-
-    for (int row = 0; row < height; row++) {
-      for (int col = 0; col < width / 2; col++) {
-        std::swap(pixels[row][col], pixels[row][width - 1 - col]);
-      }
-    }
-
-    return *this;
-  }
-
-  GSCImage &operator=(const GSCImage &img) {
-    if (this == &img) {
-      // Self-assignment check
-      return *this;
-    }
-
-    // Free existing memory
-    if (pixels != nullptr) {
-      for (int row = 0; row < height; row++) {
-        delete[] pixels[row];
-      }
-      delete[] pixels;
-      pixels = nullptr;
-    }
-
-    // Assign new dimensions and maximum luminosity
-    width = img.width;
-    height = img.height;
-    max_luminocity = img.max_luminocity;
-
-    // Allocate new memory and copy pixels
-    pixels = new GSCPixel *[height];
-    for (int row = 0; row < height; row++) {
-      pixels[row] = new GSCPixel[width];
-      for (int col = 0; col < width; col++) {
-        pixels[row][col] = img.getPixel(row, col);
-      }
-    }
-
-    return *this;
-  }
-
-  virtual Image &operator~() override;
-
-  friend std::ostream &operator<<(std::ostream &out, Image &image);
-
-  ~GSCImage() {
-    // Free the memory allocated for the pixels
-    if (pixels != nullptr) {
-      for (int row = 0; row < height; row++) {
-        delete[] pixels[row];
-      }
-      delete[] pixels;
-    }
-  }
-};
-/******************** END GSCIMAGE CLASS ********************/
+MemoryStats memoryStats;
 
 /******************** YUVIMAGE CLASS ********************/
 class YUVImage {
@@ -681,15 +55,8 @@ public:
 
   int getV(int row, int col) const { return yuvImage[row][col] & 0xFF; }
 
-  void equalizeHistogram() {
-    // Step 1: Calculate histogram
-    std::vector<int> histogram(236, 0);
-    for (int i = 0; i < height; i++) {
-      for (int j = 0; j < width; j++) {
-        int y = getY(i, j);
-        histogram[y]++;
-      }
-    }
+  // Takes the histogram of the Y component, which images keep up to date
+  void equalizeHistogram(const std::vector<int> &histogram) {
 
     // Step 2: Calculate probability distribution
     std::vector<float> probDistribution(236, 0.0);
@@ -756,19 +123,19 @@ std::ostream &operator<<(std::ostream &out, Image &image) {
 
   if (dynamic_cast<GSCImage *>(&image) != nullptr) {
     // Black and white image (PGM format)
-    out << "P2" << std::endl;
+    out << "P2\n";
     out << image.getWidth() << " " << image.getHeight() << " "
         << image.getMaxLuminocity() << "\n";
     for (int row = 0; row < image.height; row++) {
       for (int col = 0; col < image.width; col++) {
         GSCPixel &pixel = dynamic_cast<GSCImage &>(image).getPixel(row, col);
         out << static_cast<int>(pixel.getValue());
-        out << std::endl;
+        out << "\n";
       }
     }
   } else if (dynamic_cast<RGBImage *>(&image) != nullptr) {
     // Color image (PPM format)
-    out << "P3" << std::endl;
+    out << "P3\n";
     out << image.getWidth() << " " << image.getHeight() << " "
         << image.getMaxLuminocity() << "\n";
     for (int row = 0; row < image.height; row++) {
@@ -777,7 +144,7 @@ std::ostream &operator<<(std::ostream &out, Image &image) {
         out << static_cast<int>(pixel.getRed()) << " ";
         out << static_cast<int>(pixel.getGreen()) << " ";
         out << static_cast<int>(pixel.getBlue());
-        out << std::endl;
+        out << "\n";
       }
     }
   }
@@ -787,8 +154,16 @@ std::ostream &operator<<(std::ostream &out, Image &image) {
 // Definition of operator~ for RGBImage
 Image &RGBImage::operator~() {
   YUVImage yuvImage(*this);
-  yuvImage.equalizeHistogram();
-  *this = yuvImage.toRGB();
+  yuvImage.equalizeHistogram(getLumaHistogram());
+  // Write into the current rows, which may be pixels of the caller
+  RGBImage equalized = yuvImage.toRGB();
+  max_luminocity = equalized.getMaxLuminocity();
+  for (int row = 0; row < height; row++) {
+    for (int col = 0; col < width; col++) {
+      pixels[row][col] = equalized.getPixel(row, col);
+    }
+  }
+  touch();
   return *this;
 }
 
@@ -796,7 +171,7 @@ Image &RGBImage::operator~() {
 Image &GSCImage::operator~() {
   RGBImage *rgbImage = new RGBImage(*this);
   YUVImage yuvImage(*rgbImage);
-  yuvImage.equalizeHistogram();
+  yuvImage.equalizeHistogram(getLumaHistogram());
   *rgbImage = yuvImage.toRGB();
   this->width = rgbImage->getWidth();
   this->height = rgbImage->getHeight();
@@ -807,6 +182,7 @@ Image &GSCImage::operator~() {
       this->pixels[row][col].setValue(rgbImage->getPixel(row, col).getRed());
     }
   }
+  touch();
   delete rgbImage;
   return *this;
 }
@@ -817,9 +193,8 @@ RGBImage::RGBImage(const GSCImage &gsc) : pixels(nullptr) {
   max_luminocity = gsc.getMaxLuminocity();
 
   // Allocate memory for pixels
-  pixels = new RGBPixel *[height];
+  allocatePixels();
   for (int row = 0; row < height; row++) {
-    pixels[row] = new RGBPixel[width];
     for (int col = 0; col < width; col++) {
       pixels[row][col] = RGBPixel(gsc.getPixel(row, col).getValue(),
                                   gsc.getPixel(row, col).getValue(),
@@ -828,313 +203,941 @@ RGBImage::RGBImage(const GSCImage &gsc) : pixels(nullptr) {
   }
 }
 
-/******************** TOKEN CLASS ********************/
-class Token {
-private:
-  std::string name;
-  Image *ptr;
+/******************** PROFILER ********************/
+namespace {
+// One counter per event for every thread that counts, -1 for unavailable
+struct ThreadCounters {
+  std::thread::id owner;
+  int fds[Profiler::EventCount];
+};
 
-public:
-  Token(const std::string &tokenName = "", Image *imagePtr = nullptr);
-  std::string getName() const;
-  Image *getPtr() const;
-  void setName(const std::string &tokenName);
-  void setPtr(Image *imagePtr);
+struct ProfilerState {
+  std::atomic<bool> enabled{false};
+  std::mutex mutex;
+  std::vector<ThreadCounters> threads;
+  // Final counts of the threads that have ended
+  Profiler::Counts retired;
+  std::vector<std::pair<std::string, Profiler::Counts>> kernels;
+} profilerState;
+
+// Adds the counts of a thread so far to `counts`
+void addCounts(const ThreadCounters &thread, Profiler::Counts &counts) {
+  for (int event = 0; event < Profiler::EventCount; event++) {
+    // The count, the time enabled and the time actually counted
+    uint64_t values[3];
+    if (thread.fds[event] < 0 ||
+        ::read(thread.fds[event], values, sizeof(values)) != sizeof(values)) {
+      continue;
+    }
+    counts.available[event] = true;
+    if (values[2] > 0) {
+      counts.values[event] +=
+          static_cast<double>(values[0]) * values[1] / values[2];
+    }
+  }
+}
+
+// Set once the thread counts. When the thread ends, its counts go to the
+// retired ones and its counters are closed, so threads that come and go do
+// not keep file descriptors open or slow down Profiler::read().
+struct ThreadAttachment {
+  bool attached = false;
+
+  ~ThreadAttachment() {
+    if (!attached) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(profilerState.mutex);
+    auto &threads = profilerState.threads;
+    for (auto it = threads.begin(); it != threads.end(); ++it) {
+      if (it->owner != std::this_thread::get_id()) {
+        continue;
+      }
+      addCounts(*it, profilerState.retired);
+      for (int fd : it->fds) {
+        if (fd >= 0) {
+          close(fd);
+        }
+      }
+      threads.erase(it);
+      break;
+    }
+  }
 };
 
-Token::Token(const std::string &tokenName, Image *imagePtr) {
-  name = tokenName;
-  ptr = imagePtr;
+thread_local ThreadAttachment threadAttachment;
+
+int openCounter(uint32_t type, uint64_t config) {
+  perf_event_attr attributes;
+  std::memset(&attributes, 0, sizeof(attributes));
+  attributes.size = sizeof(attributes);
+  attributes.type = type;
+  attributes.config = config;
+  attributes.exclude_kernel = 1;
+  attributes.exclude_hv = 1;
+  // Scale the counts when there are more counters than the hardware has
+  attributes.read_format =
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return syscall(SYS_perf_event_open, &attributes, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
 }
 
-std::string Token::getName() const { return name; }
+uint64_t cacheMisses(uint64_t cache) {
+  return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+} // namespace
+
+bool Profiler::enable() {
+  profilerState.enabled = true;
+  attachThread();
+  std::lock_guard<std::mutex> lock(profilerState.mutex);
+  for (int fd : profilerState.threads.back().fds) {
+    if (fd >= 0) {
+      return true;
+    }
+  }
+  profilerState.enabled = false;
+  return false;
+}
+
+bool Profiler::isEnabled() { return profilerState.enabled; }
 
-Image *Token::getPtr() const { return ptr; }
+void Profiler::attachThread() {
+  if (!profilerState.enabled || threadAttachment.attached) {
+    return;
+  }
+  threadAttachment.attached = true;
+
+  ThreadCounters counters;
+  counters.owner = std::this_thread::get_id();
+  counters.fds[TaskClock] =
+      openCounter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK);
+  counters.fds[Cycles] =
+      openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+  counters.fds[Instructions] =
+      openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+  counters.fds[L1Misses] =
+      openCounter(PERF_TYPE_HW_CACHE, cacheMisses(PERF_COUNT_HW_CACHE_L1D));
+  counters.fds[LLCMisses] =
+      openCounter(PERF_TYPE_HW_CACHE, cacheMisses(PERF_COUNT_HW_CACHE_LL));
+  counters.fds[BranchMisses] =
+      openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+
+  std::lock_guard<std::mutex> lock(profilerState.mutex);
+  profilerState.threads.push_back(counters);
+}
 
-void Token::setName(const std::string &tokenName) { name = tokenName; }
+Profiler::Counts Profiler::read() {
+  std::lock_guard<std::mutex> lock(profilerState.mutex);
+  Counts counts = profilerState.retired;
+  for (const auto &thread : profilerState.threads) {
+    addCounts(thread, counts);
+  }
+  return counts;
+}
 
-void Token::setPtr(Image *imagePtr) { ptr = imagePtr; }
-/******************** END TOKEN CLASS ********************/
+Profiler::Counts Profiler::difference(const Counts &end, const Counts &start) {
+  Counts counts;
+  for (int event = 0; event < EventCount; event++) {
+    counts.values[event] = end.values[event] - start.values[event];
+    counts.available[event] = end.available[event] && start.available[event];
+  }
+  counts.pixels = end.pixels - start.pixels;
+  return counts;
+}
 
-/******************** MAIN ********************/
-std::vector<Token>::iterator findToken(std::vector<Token> &tokenList,
-                                       const std::string &token) {
-  return std::find_if(tokenList.begin(), tokenList.end(),
-                      [&](const Token &t) { return t.getName() == token; });
+// Formats the CPU time, the instructions per cycle and the rates per pixel
+std::string Profiler::describe(const Counts &counts) {
+  std::ostringstream text;
+  text.precision(4);
+  auto value = [&](Event event, double divisor) -> std::string {
+    if (!counts.available[event] || divisor <= 0) {
+      return "n/a";
+    }
+    std::ostringstream number;
+    number.precision(4);
+    number << counts.values[event] / divisor;
+    return number.str();
+  };
+
+  text << value(TaskClock, 1e6) << " ms CPU, " << counts.pixels
+       << " pixels, IPC "
+       << (counts.available[Cycles] ? value(Instructions, counts.values[Cycles])
+                                    : "n/a")
+       << ", per pixel: " << value(Cycles, counts.pixels) << " cycles, "
+       << value(L1Misses, counts.pixels) << " L1 misses, "
+       << value(LLCMisses, counts.pixels) << " LLC misses, "
+       << value(BranchMisses, counts.pixels) << " branch misses";
+  return text.str();
 }
 
-bool fileExists(const std::string &filename) {
-  std::ifstream file(filename);
-  return file.good();
+void Profiler::recordKernel(const std::string &name, const Counts &counts) {
+  std::lock_guard<std::mutex> lock(profilerState.mutex);
+  profilerState.kernels.emplace_back(name, counts);
 }
 
-Image *readNetpbmImage(const char *filename) {
-  std::ifstream f(filename);
-  if (!f.is_open()) {
-    std::cout << "[ERROR] Unable to open " << filename << std::endl;
+std::vector<std::pair<std::string, Profiler::Counts>> Profiler::takeKernels() {
+  std::lock_guard<std::mutex> lock(profilerState.mutex);
+  std::vector<std::pair<std::string, Counts>> kernels;
+  kernels.swap(profilerState.kernels);
+  return kernels;
+}
+
+ProfileScope::ProfileScope(const std::string &kernelName, uint64_t pixelCount)
+    : name(kernelName), pixels(pixelCount) {
+  if (Profiler::isEnabled()) {
+    Profiler::attachThread();
+    start = Profiler::read();
   }
-  Image *img_ptr = nullptr;
-  std::string type;
+}
 
-  if (f.good() && !f.eof())
-    f >> type;
-  if (!type.compare("P3")) {
-    img_ptr = new RGBImage(f);
-  } else if (!type.compare("P2")) {
-    img_ptr = new GSCImage(f);
-  } else if (f.is_open()) {
-    std::cout << "[ERROR] Invalid file format" << std::endl;
+ProfileScope::~ProfileScope() {
+  if (Profiler::isEnabled()) {
+    Profiler::Counts counts = Profiler::difference(Profiler::read(), start);
+    counts.pixels = pixels;
+    Profiler::recordKernel(name, counts);
   }
-  return img_ptr;
 }
+/******************** END PROFILER ********************/
 
-void exportImageToFile(const std::string &filename, Image &image) {
-  // Open the file for writing
-  std::ofstream file(filename);
-  if (!file) {
-    std::cout << "[ERROR] Unable to create file" << std::endl;
-    return;
+/******************** THREAD POOL CLASS ********************/
+thread_local ThreadPool *ThreadPool::currentPool = nullptr;
+thread_local int ThreadPool::currentWorker = -1;
+
+ThreadPool::ThreadPool(int threadCount)
+    : queuedTasks(0), nextQueue(0), stopping(false) {
+  threadCount = std::max(1, threadCount);
+  for (int worker = 0; worker < threadCount; worker++) {
+    queues.push_back(std::make_unique<TaskQueue>());
+  }
+  for (int worker = 0; worker < threadCount; worker++) {
+    workers.emplace_back(&ThreadPool::workerLoop, this, worker);
   }
+}
 
-  file << image;
+void ThreadPool::submit(std::function<void()> task) {
+  int queue = currentPool == this
+                  ? currentWorker
+                  : static_cast<int>(nextQueue++ % queues.size());
+  {
+    std::lock_guard<std::mutex> queueLock(queues[queue]->mutex);
+    queues[queue]->tasks.push_back(std::move(task));
+  }
+  queuedTasks++;
 
-  file.close();
+  // Taking the lock orders this wake-up after a worker's last check
+  { std::lock_guard<std::mutex> lock(sleepMutex); }
+  wakeUp.notify_one();
+}
+
+bool ThreadPool::runNextTask(int worker) {
+  std::function<void()> task;
+  int queueCount = static_cast<int>(queues.size());
+
+  for (int offset = 0; offset < queueCount && !task; offset++) {
+    TaskQueue &queue = *queues[(worker + offset) % queueCount];
+    std::lock_guard<std::mutex> queueLock(queue.mutex);
+    if (queue.tasks.empty()) {
+      continue;
+    }
+    if (offset == 0) {
+      task = std::move(queue.tasks.back());
+      queue.tasks.pop_back();
+    } else {
+      task = std::move(queue.tasks.front());
+      queue.tasks.pop_front();
+    }
+  }
+
+  if (!task) {
+    return false;
+  }
+  queuedTasks--;
+  // Threads started before profiling was enabled start counting now
+  Profiler::attachThread();
+  task();
+  return true;
 }
 
-void deleteToken(Token &token) {
-  if (token.getPtr()) {
-    delete token.getPtr();
-    token.setPtr(nullptr);
+// Runs body(0) to body(count - 1) on the pool and returns once all of them
+// have finished. The calling thread takes part, so this may also be called
+// from a task of the pool. At most `maxThreads` threads work on the loop,
+// or all of the pool if it is 0.
+void ThreadPool::parallelFor(int count, const std::function<void(int)> &body,
+                             int maxThreads) {
+  struct Loop {
+    std::function<void(int)> body;
+    int count;
+    std::atomic<int> next;
+    std::atomic<int> finished;
+    std::mutex mutex;
+    std::condition_variable done;
+  };
+
+  auto loop = std::make_shared<Loop>();
+  loop->body = body;
+  loop->count = count;
+  loop->next = 0;
+  loop->finished = 0;
+
+  auto work = [loop]() {
+    int index;
+    while ((index = loop->next++) < loop->count) {
+      loop->body(index);
+      if (++loop->finished == loop->count) {
+        std::lock_guard<std::mutex> lock(loop->mutex);
+        loop->done.notify_all();
+      }
+    }
+  };
+
+  int threads = maxThreads > 0 ? std::min(maxThreads, getThreadCount())
+                               : getThreadCount();
+  int helpers = std::min(count, threads) - 1;
+  for (int helper = 0; helper < helpers; helper++) {
+    submit(work);
   }
+  work();
+
+  std::unique_lock<std::mutex> lock(loop->mutex);
+  loop->done.wait(lock, [&]() { return loop->finished == loop->count; });
 }
 
-void invertColor(Image &image) { image = !image; }
+void ThreadPool::workerLoop(int worker) {
+  currentPool = this;
+  currentWorker = worker;
+  Profiler::attachThread();
 
-void histogramEqualization(Image &image) { image = ~image; }
+  while (true) {
+    if (runNextTask(worker)) {
+      continue;
+    }
 
-void invertImageInYAxis(Image &image) { image = *image; }
+    std::unique_lock<std::mutex> lock(sleepMutex);
+    wakeUp.wait(lock, [this]() { return stopping || queuedTasks > 0; });
+    if (stopping && queuedTasks == 0) {
+      return;
+    }
+  }
+}
 
-Image *rgbToGsc(Image &image, std::string name) {
-  RGBImage *rgbImage = dynamic_cast<RGBImage *>(&image);
-  if (rgbImage) {
-    GSCImage *gscImage = new GSCImage(*rgbImage);
-    delete &image;
-    std::cout << "[OK] Grayscale " << name << "\n";
-    return gscImage;
-  } else {
-    std::cout << "[NOP] Already grayscale " << name << "\n";
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(sleepMutex);
+    stopping = true;
+  }
+  wakeUp.notify_all();
+  for (auto &worker : workers) {
+    worker.join();
   }
-  return &image;
 }
 
-void scale(Image &image, double factor) { image *= factor; }
+namespace {
+int poolThreadCount = std::max(1u, std::thread::hardware_concurrency());
+}
 
-void rotate(Image &image, int times) { image += times; }
+void setThreadCount(int threadCount) {
+  poolThreadCount = std::max(1, threadCount);
+}
 
-int main() {
-  std::vector<Token> tokenList;
+// The pool shared by everything that runs in parallel
+ThreadPool &getThreadPool() {
+  static ThreadPool pool(poolThreadCount);
+  return pool;
+}
+/******************** END THREAD POOL CLASS ********************/
 
-  while (true) {
-    std::string line;
-    std::getline(std::cin, line);
+/******************** CODECS ********************/
+Image *readNetpbmImage(std::istream &f) {
+  Image *img_ptr = nullptr;
+  std::string type;
 
-    std::istringstream iss(line);
-    std::string command;
-    iss >> command;
+  if (f.good() && !f.eof())
+    f >> type;
+  if (!type.compare("P3")) {
+    img_ptr = new RGBImage(f);
+  } else if (!type.compare("P2")) {
+    img_ptr = new GSCImage(f);
+  }
+  return img_ptr;
+}
+/******************** END CODECS ********************/
+
+/******************** WARP ********************/
+void buildAffineMatrix(double degrees, double shearX, double shearY,
+                       double factor, double matrix[4]) {
+  double angle = degrees * M_PI / 180;
+  double cosine = std::cos(angle);
+  double sine = std::sin(angle);
+  matrix[0] = factor * (cosine - sine * shearY);
+  matrix[1] = factor * (cosine * shearX - sine);
+  matrix[2] = factor * (sine + cosine * shearY);
+  matrix[3] = factor * (sine * shearX + cosine);
+}
 
-    if (command == "i") {
-      std::string photoFile;
-      std::string as;
-      std::string name;
-      iss >> photoFile >> as >> name;
+// Warps the image by an affine matrix into a new image. The result is cut
+// into tiles that are filled in parallel, so every thread writes a small
+// block and reads a compact region of the source.
+Image *warp(const Image &image, const double matrix[4], bool bilinear) {
+  const KernelTuning tuning =
+      getTuning(TunedKernel::Warp, image.getChannels());
+  const int tileSize = tuning.blockSize;
+  WarpGeometry geometry = WarpGeometry::fromMatrix(
+      matrix, image.getWidth(), image.getHeight(), bilinear);
+  Image *warped = image.createBlank(geometry.width, geometry.height);
+
+  int tileColumns = (geometry.width + tileSize - 1) / tileSize;
+  int tileRows = (geometry.height + tileSize - 1) / tileSize;
+  getThreadPool().parallelFor(tileColumns * tileRows, [&](int tile) {
+    int top = tile / tileColumns * tileSize;
+    int left = tile % tileColumns * tileSize;
+    warped->warpTile(image, geometry, top,
+                     std::min(top + tileSize, geometry.height), left,
+                     std::min(left + tileSize, geometry.width));
+  }, tuning.threads);
+  return warped;
+}
+/******************** END WARP ********************/
+
+/******************** CONVOLUTION ********************/
+// Maps an index outside of 0 to size - 1 back into the image, or returns -1
+// for a zero border.
+int borderIndex(int index, int size, BorderMode border) {
+  if (index >= 0 && index < size) {
+    return index;
+  }
+  switch (border) {
+  case BorderMode::Clamp:
+    return index < 0 ? 0 : size - 1;
+  case BorderMode::Mirror: {
+    // Reflect around the edge pixels: -1 is 1 and size is size - 2
+    if (size == 1) {
+      return 0;
+    }
+    int period = 2 * size - 2;
+    index = std::abs(index) % period;
+    return index < size ? index : period - index;
+  }
+  case BorderMode::Zero:
+    break;
+  }
+  return -1;
+}
 
-      if (photoFile.empty() || name.empty() || name[0] != '$' || as != "as") {
-        std::cout << "\n-- Invalid command! --\n";
-        continue;
-      }
+int divideRounded(int value, int divisor) {
+  return value >= 0 ? (value + divisor / 2) / divisor
+                    : -((-value + divisor / 2) / divisor);
+}
 
-      if (!fileExists(photoFile)) {
-        std::cout << "[ERROR] Unable to open " << photoFile << "\n";
-        continue;
-      }
+SeparableKernel boxKernel(int radius) {
+  int taps = 2 * radius + 1;
+  return {std::vector<int>(taps, 1), std::vector<int>(taps, 1), taps * taps,
+          true};
+}
 
-      Image *imgPtr = readNetpbmImage(photoFile.c_str());
-      auto it = findToken(tokenList, name);
-      if (it != tokenList.end()) {
-        std::cout << "[ERROR] Token " << name << " already exists!\n";
-        continue;
+// Gaussian with a standard deviation of half the radius, in weights of at
+// most 64
+SeparableKernel gaussianKernel(int radius) {
+  double sigma = std::max(radius / 2.0, 0.5);
+  std::vector<int> weights;
+  int sum = 0;
+  for (int offset = -radius; offset <= radius; offset++) {
+    weights.push_back(static_cast<int>(
+        std::lround(64 * std::exp(-offset * offset / (2 * sigma * sigma)))));
+    sum += weights.back();
+  }
+  return {weights, weights, sum * sum, false};
+}
+
+// Convolves in two 1-D passes. Bands of rows are filtered in parallel; each
+// band runs the horizontal pass once per source row into a ring of the last
+// rows, which the vertical pass then combines.
+SamplePlane convolveSeparable(const SamplePlane &source,
+                              const SeparableKernel &kernel,
+                              BorderMode border) {
+  const int channels = source.channels;
+  const KernelTuning tuning = getTuning(TunedKernel::Filter, channels);
+  const int bandHeight = tuning.blockSize;
+  const int rowLength = source.width * channels;
+  const int radiusH = kernel.horizontal.size() / 2;
+  const int radiusV = kernel.vertical.size() / 2;
+  const int taps = kernel.vertical.size();
+
+  SamplePlane result = {source.width, source.height, channels,
+                        std::vector<int>(source.samples.size())};
+  int bands = (source.height + bandHeight - 1) / bandHeight;
+
+  getThreadPool().parallelFor(bands, [&](int band) {
+    int top = band * bandHeight;
+    int bottom = std::min(top + bandHeight, source.height);
+    std::vector<std::vector<int>> ring(taps, std::vector<int>(rowLength));
+    std::vector<int> padded((source.width + 2 * radiusH) * channels);
+    std::vector<int> sums(rowLength, 0);
+    auto slot = [&](int sourceRow) { return (sourceRow - top + radiusV) % taps; };
+
+    // Horizontal pass over one source row, border rows included
+    auto filterRow = [&](int sourceRow) {
+      std::vector<int> &filtered = ring[slot(sourceRow)];
+      int row = borderIndex(sourceRow, source.height, border);
+      if (row < 0) {
+        std::fill(filtered.begin(), filtered.end(), 0);
+        return;
       }
 
-      Token token;
-      token.setName(name);
-      token.setPtr(imgPtr);
-      tokenList.push_back(token); // Add the token to the list
-      std::cout << "[OK] Import " << name << "\n";
-    } else if (command == "e") {
-      std::string photoFile;
-      std::string as;
-      std::string name;
-      iss >> name >> as >> photoFile;
-
-      if (photoFile.empty() || name.empty() || name[0] != '$' || as != "as") {
-        std::cout << "\n-- Invalid command! --\n";
-        continue;
+      const int *samples = source.row(row);
+      for (int col = -radiusH; col < source.width + radiusH; col++) {
+        int sourceCol = borderIndex(col, source.width, border);
+        for (int channel = 0; channel < channels; channel++) {
+          padded[(col + radiusH) * channels + channel] =
+              sourceCol < 0 ? 0 : samples[sourceCol * channels + channel];
+        }
       }
 
-      auto it = findToken(tokenList, name);
-      if (it == tokenList.end()) {
-        std::cout << "[ERROR] Token " << name << " not found!\n";
-        continue;
+      if (kernel.box) {
+        // Slide the window: add the sample entering, drop the one leaving
+        int span = 2 * radiusH * channels;
+        for (int i = 0; i < channels; i++) {
+          filtered[i] = 0;
+          for (int k = 0; k <= span; k += channels) {
+            filtered[i] += padded[i + k];
+          }
+        }
+        for (int i = channels; i < rowLength; i++) {
+          filtered[i] = filtered[i - channels] + padded[i + span] -
+                        padded[i - channels];
+        }
+        return;
       }
 
-      if (fileExists(photoFile)) {
-        std::cout << "[ERROR] File exists\n";
-        continue;
+      // One weight at a time over the whole row keeps the inner loop a
+      // plain multiply-add over contiguous samples
+      std::fill(filtered.begin(), filtered.end(), 0);
+      for (int k = 0; k < static_cast<int>(kernel.horizontal.size()); k++) {
+        int weight = kernel.horizontal[k];
+        const int *shifted = padded.data() + k * channels;
+        if (weight != 0) {
+          for (int i = 0; i < rowLength; i++) {
+            filtered[i] += weight * shifted[i];
+          }
+        }
       }
+    };
 
-      Token &token = *it;
-      exportImageToFile(photoFile, *(token.getPtr()));
-      std::cout << "[OK] Export " << name << "\n";
-    } else if (command == "d") {
-      std::string name;
-      iss >> name;
+    for (int sourceRow = top - radiusV; sourceRow < top + radiusV;
+         sourceRow++) {
+      filterRow(sourceRow);
+    }
 
-      if (name.empty() || name[0] != '$') {
-        std::cout << "\n-- Invalid command! --\n";
-        continue;
-      }
+    for (int row = top; row < bottom; row++) {
+      int *target = result.row(row);
 
-      auto it = findToken(tokenList, name);
-      if (it == tokenList.end()) {
-        std::cout << "[ERROR] Token " << name << " not found!\n";
-        continue;
-      }
-      Token &token = *it;
-      deleteToken(token);
-      std::cout << "[OK] Delete " << token.getName() << "\n";
-      tokenList.erase(it);
-    } else if (command == "n") {
-      std::string name;
-      iss >> name;
-
-      if (name.empty() || name[0] != '$') {
-        std::cout << "\n-- Invalid command! --\n";
-        continue;
+      if (kernel.box) {
+        // The row leaving the window shares its slot with the one entering
+        if (row > top) {
+          const std::vector<int> &leaving = ring[slot(row + radiusV)];
+          for (int i = 0; i < rowLength; i++) {
+            sums[i] -= leaving[i];
+          }
+        }
+        filterRow(row + radiusV);
+        if (row == top) {
+          for (const auto &filtered : ring) {
+            for (int i = 0; i < rowLength; i++) {
+              sums[i] += filtered[i];
+            }
+          }
+        } else {
+          const std::vector<int> &entering = ring[slot(row + radiusV)];
+          for (int i = 0; i < rowLength; i++) {
+            sums[i] += entering[i];
+          }
+        }
+      } else {
+        filterRow(row + radiusV);
+        std::fill(sums.begin(), sums.end(), 0);
+        for (int k = 0; k < taps; k++) {
+          int weight = kernel.vertical[k];
+          const std::vector<int> &filtered = ring[slot(row - radiusV + k)];
+          if (weight != 0) {
+            for (int i = 0; i < rowLength; i++) {
+              sums[i] += weight * filtered[i];
+            }
+          }
+        }
       }
 
-      auto it = findToken(tokenList, name);
-      if (it == tokenList.end()) {
-        std::cout << "[ERROR] Token " << name << " not found!\n";
-        continue;
-      }
-      Token &token = *it;
-      invertColor(*(token.getPtr()));
-      std::cout << "[OK] Color Inversion " << token.getName() << "\n";
-    } else if (command == "z") {
-      std::string name;
-      iss >> name;
-
-      if (name.empty() || name[0] != '$') {
-        std::cout << "\n-- Invalid command! --\n";
-        continue;
+      for (int i = 0; i < rowLength; i++) {
+        target[i] = divideRounded(sums[i], kernel.divisor);
       }
+    }
+  }, tuning.threads);
 
-      auto it = findToken(tokenList, name);
-      if (it == tokenList.end()) {
-        std::cout << "[ERROR] Token " << name << " not found!\n";
-        continue;
-      }
-      Token &token = *it;
-      histogramEqualization(*(token.getPtr()));
-      std::cout << "[OK] Equalize " << token.getName() << "\n";
-    } else if (command == "m") {
-      std::string name;
-      iss >> name;
-
-      if (name.empty() || name[0] != '$') {
-        std::cout << "\n-- Invalid command! --\n";
-        continue;
-      }
+  return result;
+}
 
-      auto it = findToken(tokenList, name);
-      if (it == tokenList.end()) {
-        std::cout << "[ERROR] Token " << name << " not found!\n";
-        continue;
-      }
-      Token &token = *it;
-      invertImageInYAxis(*(token.getPtr()));
-      std::cout << "[OK] Mirror " << token.getName() << "\n";
-    } else if (command == "g") {
-      std::string name;
-      iss >> name;
-
-      if (name.empty() || name[0] != '$') {
-        std::cout << "\n-- Invalid command! --\n";
-        continue;
+// Reference 2-D convolution with the full product of the two kernels
+SamplePlane convolveNaive(const SamplePlane &source,
+                          const SeparableKernel &kernel, BorderMode border) {
+  const int radiusH = kernel.horizontal.size() / 2;
+  const int radiusV = kernel.vertical.size() / 2;
+  SamplePlane result = {source.width, source.height, source.channels,
+                        std::vector<int>(source.samples.size())};
+
+  for (int row = 0; row < source.height; row++) {
+    for (int col = 0; col < source.width; col++) {
+      for (int channel = 0; channel < source.channels; channel++) {
+        int sum = 0;
+        for (int dy = -radiusV; dy <= radiusV; dy++) {
+          int sourceRow = borderIndex(row + dy, source.height, border);
+          for (int dx = -radiusH; dx <= radiusH; dx++) {
+            int sourceCol = borderIndex(col + dx, source.width, border);
+            if (sourceRow < 0 || sourceCol < 0) {
+              continue;
+            }
+            sum += kernel.vertical[dy + radiusV] *
+                   kernel.horizontal[dx + radiusH] *
+                   source.row(sourceRow)[sourceCol * source.channels + channel];
+          }
+        }
+        result.row(row)[col * source.channels + channel] =
+            divideRounded(sum, kernel.divisor);
       }
+    }
+  }
+  return result;
+}
 
-      auto it = findToken(tokenList, name);
-      if (it == tokenList.end()) {
-        std::cout << "[ERROR] Token " << name << " not found!\n";
-        continue;
+// Gaussian blur. Small radii use the exact kernel, larger ones three box
+// passes of about the same spread, which cost the same at any radius.
+SamplePlane blur(const SamplePlane &source, int radius, BorderMode border) {
+  const int largestExactRadius = 4;
+  if (radius <= largestExactRadius) {
+    return convolveSeparable(source, gaussianKernel(radius), border);
+  }
+
+  // Three boxes of radius b have a variance of b * (b + 1)
+  double sigma = radius / 2.0;
+  int boxRadius = std::max(
+      1, static_cast<int>(std::lround((std::sqrt(1 + 4 * sigma * sigma) - 1) / 2)));
+  SamplePlane result = source;
+  for (int pass = 0; pass < 3; pass++) {
+    result = convolveSeparable(result, boxKernel(boxRadius), border);
+  }
+  return result;
+}
+
+SamplePlane toSamplePlane(const Image &image) {
+  SamplePlane plane = {image.getWidth(), image.getHeight(),
+                       image.getChannels(),
+                       std::vector<int>(static_cast<size_t>(image.getWidth()) *
+                                        image.getHeight() *
+                                        image.getChannels())};
+  getThreadPool().parallelFor(plane.height, [&](int row) {
+    std::vector<unsigned char> bytes(plane.width * plane.channels);
+    image.getRowBytes(row, bytes.data());
+    std::copy(bytes.begin(), bytes.end(), plane.row(row));
+  });
+  return plane;
+}
+
+// Writes the samples back, clamped to the range of the image
+void fromSamplePlane(const SamplePlane &plane, Image &image) {
+  int maximum = image.getMaxLuminocity();
+  getThreadPool().parallelFor(plane.height, [&](int row) {
+    std::vector<unsigned char> bytes(plane.width * plane.channels);
+    const int *samples = plane.row(row);
+    for (size_t i = 0; i < bytes.size(); i++) {
+      bytes[i] = static_cast<unsigned char>(
+          std::min(std::max(samples[i], 0), maximum));
+    }
+    image.setRowBytes(row, bytes.data());
+  });
+  image.touch();
+}
+
+void filterImage(Image &image, FilterType type, int radius, BorderMode border) {
+  SamplePlane source = toSamplePlane(image);
+  SamplePlane result;
+
+  switch (type) {
+  case FilterType::Box:
+    result = convolveSeparable(source, boxKernel(radius), border);
+    break;
+  case FilterType::Blur:
+    result = blur(source, radius, border);
+    break;
+  case FilterType::Sharpen: {
+    // Unsharp mask: add back the detail that a blur removes
+    result = blur(source, radius, border);
+    for (size_t i = 0; i < result.samples.size(); i++) {
+      result.samples[i] = 2 * source.samples[i] - result.samples[i];
+    }
+    break;
+  }
+  case FilterType::Edge: {
+    // Magnitude of the Sobel gradient
+    SamplePlane gradientX =
+        convolveSeparable(source, {{-1, 0, 1}, {1, 2, 1}, 1, false}, border);
+    result = convolveSeparable(source, {{1, 2, 1}, {-1, 0, 1}, 1, false},
+                               border);
+    for (size_t i = 0; i < result.samples.size(); i++) {
+      double x = gradientX.samples[i];
+      double y = result.samples[i];
+      result.samples[i] = static_cast<int>(std::sqrt(x * x + y * y));
+    }
+    break;
+  }
+  }
+
+  fromSamplePlane(result, image);
+}
+/******************** END CONVOLUTION ********************/
+
+/******************** IMAGE STATISTICS ********************/
+// Counts the values of every channel in bands of rows in parallel and
+// derives the rest from the counts, which for bytes is cheaper and exact.
+// Every channel has four interleaved histograms, so that runs of equal
+// values do not wait on the same counter.
+std::vector<ChannelStatistics> computeStatistics(const Image &image) {
+  const int bandHeight = 64;
+  const int lanes = 4;
+  const int channels = image.getChannels();
+  const int rowLength = image.getWidth() * channels;
+  const int bands = (image.getHeight() + bandHeight - 1) / bandHeight;
+
+  // Indexed by band, then lane, channel and value
+  std::vector<std::vector<uint32_t>> counts(bands);
+  getThreadPool().parallelFor(bands, [&](int band) {
+    std::vector<uint32_t> &bandCounts = counts[band];
+    bandCounts.assign(static_cast<size_t>(lanes) * channels * 256, 0);
+    std::vector<unsigned char> bytes(rowLength);
+    int bottom = std::min((band + 1) * bandHeight, image.getHeight());
+
+    for (int row = band * bandHeight; row < bottom; row++) {
+      image.getRowBytes(row, bytes.data());
+      int i = 0;
+      for (; i + lanes * channels <= rowLength; i += lanes * channels) {
+        for (int lane = 0; lane < lanes; lane++) {
+          for (int channel = 0; channel < channels; channel++) {
+            bandCounts[(lane * channels + channel) * 256 +
+                       bytes[i + lane * channels + channel]]++;
+          }
+        }
       }
-      Token &token = *it;
-      token.setPtr(rgbToGsc(*(token.getPtr()), token.getName()));
-    } else if (command == "s") {
-      std::string factor;
-      std::string by;
-      std::string name;
-      iss >> name >> by >> factor;
-
-      if (factor.empty() || name.empty() || name[0] != '$' || by != "by") {
-        std::cout << "\n-- Invalid command! --";
-        continue;
+      for (; i < rowLength; i++) {
+        bandCounts[(i % channels) * 256 + bytes[i]]++;
       }
-
-      auto it = findToken(tokenList, name);
-      if (it == tokenList.end()) {
-        std::cout << "[ERROR] Token " << name << " not found!\n";
-        continue;
+    }
+  });
+
+  std::vector<ChannelStatistics> statistics(channels);
+  for (int channel = 0; channel < channels; channel++) {
+    std::vector<uint64_t> histogram(256, 0);
+    for (const auto &bandCounts : counts) {
+      for (int lane = 0; lane < lanes; lane++) {
+        const uint32_t *laneCounts =
+            bandCounts.data() + (lane * channels + channel) * 256;
+        for (int value = 0; value < 256; value++) {
+          histogram[value] += laneCounts[value];
+        }
       }
+    }
 
-      if (std::stod(factor) > 2 || std::stod(factor) < 0) {
-        std::cout << "[ERROR] Wrong factor!" << factor << "\n";
-        continue;
+    ChannelStatistics &result = statistics[channel];
+    result.minimum = -1;
+    result.maximum = 0;
+    uint64_t pixelCount = 0;
+    double sum = 0;
+    double squares = 0;
+    for (int value = 0; value < 256; value++) {
+      if (histogram[value] > 0) {
+        if (result.minimum < 0) {
+          result.minimum = value;
+        }
+        result.maximum = value;
+        pixelCount += histogram[value];
+        sum += static_cast<double>(histogram[value]) * value;
+        squares += static_cast<double>(histogram[value]) * value * value;
       }
+    }
 
-      Token &token = *it;
-      scale(*(token.getPtr()), std::stod(factor));
-      std::cout << "[OK] Scale " << token.getName() << "\n";
-    } else if (command == "r") {
-      std::string times;
-      std::string clockwise;
-      std::string name;
-      iss >> name >> clockwise >> times;
-
-      if (times.empty() || name.empty() || name[0] != '$' ||
-          clockwise != "clockwise") {
-        std::cout << "\n-- Invalid command! --\n";
-        continue;
-      }
+    result.minimum = std::max(result.minimum, 0);
+    result.mean = pixelCount > 0 ? sum / pixelCount : 0;
+    result.standardDeviation =
+        pixelCount > 0
+            ? std::sqrt(std::max(squares / pixelCount -
+                                     result.mean * result.mean,
+                                 0.0))
+            : 0;
+    histogram.resize(
+        std::min(std::max(image.getMaxLuminocity(), result.maximum) + 1, 256));
+    result.histogram = std::move(histogram);
+  }
+  return statistics;
+}
+/******************** END IMAGE STATISTICS ********************/
+
+/******************** TUNING ********************/
+namespace {
+// Indexed by kernel and by kind of image, black and white first
+KernelTuning tunings[3][2] = {{{64, 0}, {64, 0}},
+                              {{64, 0}, {64, 0}},
+                              {{32, 0}, {32, 0}}};
+const char *tunedKernelNames[3] = {"warp", "filter", "rotate"};
+const char *formatNames[2] = {"gray", "color"};
+
+int formatIndex(int channels) { return channels == 1 ? 0 : 1; }
+
+// Tunings only carry over to machines with the same processor and number
+// of hardware threads
+std::string describeMachine() {
+  std::ifstream cpuinfo("/proc/cpuinfo");
+  std::string line;
+  std::string model = "unknown";
+  while (std::getline(cpuinfo, line)) {
+    if (line.compare(0, 10, "model name") == 0) {
+      model = line.substr(line.find(':') + 2);
+      break;
+    }
+  }
+  std::ostringstream text;
+  text << model << " / " << std::thread::hardware_concurrency();
+  return text.str();
+}
 
-      auto it = findToken(tokenList, name);
-      if (it == tokenList.end()) {
-        std::cout << "[ERROR] Token " << name << " not found!\n";
-        continue;
-      }
+// Fastest of a few runs, in milliseconds
+double timeKernel(const std::function<void()> &run) {
+  double best = 1e300;
+  for (int attempt = 0; attempt < 3; attempt++) {
+    auto start = std::chrono::steady_clock::now();
+    run();
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    best = std::min(best, elapsed.count());
+  }
+  return best;
+}
+
+// Tries every block size with the whole pool, then fewer threads with the
+// best block size, and keeps the fastest setting
+void tuneKernel(TunedKernel kernel, int channels,
+                const std::vector<int> &blockSizes, bool parallel,
+                const std::function<void()> &run, std::ostream &report) {
+  KernelTuning best = getTuning(kernel, channels);
+  double bestTime = 1e300;
+  for (int blockSize : blockSizes) {
+    setTuning(kernel, channels, {blockSize, 0});
+    double time = timeKernel(run);
+    if (time < bestTime) {
+      bestTime = time;
+      best = {blockSize, 0};
+    }
+  }
+
+  int poolThreads = getThreadPool().getThreadCount();
+  for (int threads = 1; parallel && threads < poolThreads; threads *= 2) {
+    setTuning(kernel, channels, {best.blockSize, threads});
+    double time = timeKernel(run);
+    if (time < bestTime) {
+      bestTime = time;
+      best.threads = threads;
+    }
+  }
 
-      Token &token = *it;
-      rotate(*(token.getPtr()), std::stod(times));
-      std::cout << "[OK] Rotate " << token.getName() << "\n";
-    } else if (command == "q") {
-      for (auto &token : tokenList) {
-        deleteToken(token);
+  setTuning(kernel, channels, best);
+  report << "[TUNE] " << tunedKernelNames[static_cast<int>(kernel)] << " "
+         << formatNames[formatIndex(channels)] << ": block " << best.blockSize;
+  if (parallel) {
+    report << ", " << (best.threads > 0 ? best.threads : poolThreads)
+           << " threads";
+  }
+  report << ", " << bestTime << " ms\n";
+}
+} // namespace
+
+KernelTuning getTuning(TunedKernel kernel, int channels) {
+  return tunings[static_cast<int>(kernel)][formatIndex(channels)];
+}
+
+void setTuning(TunedKernel kernel, int channels, const KernelTuning &tuning) {
+  KernelTuning checked = {std::max(1, tuning.blockSize),
+                          std::max(0, tuning.threads)};
+  tunings[static_cast<int>(kernel)][formatIndex(channels)] = checked;
+}
+
+bool loadTuning(const std::string &filename) {
+  std::ifstream file(filename);
+  std::string line;
+  if (!std::getline(file, line) || line != "machine " + describeMachine()) {
+    return false;
+  }
+
+  std::string kernelName;
+  std::string formatName;
+  KernelTuning tuning;
+  while (file >> kernelName >> formatName >> tuning.blockSize >>
+         tuning.threads) {
+    for (int kernel = 0; kernel < 3; kernel++) {
+      for (int format = 0; format < 2; format++) {
+        if (kernelName == tunedKernelNames[kernel] &&
+            formatName == formatNames[format]) {
+          setTuning(static_cast<TunedKernel>(kernel), format == 0 ? 1 : 3,
+                    tuning);
+        }
       }
+    }
+  }
+  return file.eof();
+}
 
-      tokenList.clear(); // Clear the vector after deleting tokens
-      break;
+bool saveTuning(const std::string &filename) {
+  std::ofstream file(filename);
+  file << "machine " << describeMachine() << "\n";
+  for (int kernel = 0; kernel < 3; kernel++) {
+    for (int format = 0; format < 2; format++) {
+      const KernelTuning &tuning = tunings[kernel][format];
+      file << tunedKernelNames[kernel] << " " << formatNames[format] << " "
+           << tuning.blockSize << " " << tuning.threads << "\n";
+    }
+  }
+  file.close();
+  return static_cast<bool>(file);
+}
+
+void calibrate(std::ostream &report) {
+  const int size = 512;
+  const std::vector<int> tileSizes = {16, 32, 64, 128, 256};
+  const std::vector<int> bandHeights = {8, 16, 32, 64, 128, 256};
+  const std::vector<int> rotationTiles = {8, 16, 32, 64, 128};
+
+  for (int channels : {1, 3}) {
+    // A pattern with some detail, so no kernel takes a shortcut
+    std::vector<unsigned char> bytes(static_cast<size_t>(size) * size *
+                                     channels);
+    for (size_t i = 0; i < bytes.size(); i++) {
+      bytes[i] = static_cast<unsigned char>((i * 2654435761u) >> 13);
+    }
+    std::unique_ptr<Image> image;
+    if (channels == 1) {
+      image.reset(new GSCImage(size, size, 255, bytes.data()));
+    } else {
+      image.reset(new RGBImage(size, size, 255, bytes.data()));
     }
+
+    double matrix[4];
+    buildAffineMatrix(30, 0, 0, 1, matrix);
+    tuneKernel(TunedKernel::Warp, channels, tileSizes, true,
+               [&]() { delete warp(*image, matrix, true); }, report);
+
+    SamplePlane plane = toSamplePlane(*image);
+    SeparableKernel kernel = gaussianKernel(2);
+    tuneKernel(TunedKernel::Filter, channels, bandHeights, true,
+               [&]() { convolveSeparable(plane, kernel, BorderMode::Clamp); },
+               report);
+
+    // Only turning a square image goes through tiles
+    tuneKernel(TunedKernel::RotateInPlace, channels, rotationTiles, false,
+               [&]() { image->rotateInPlace(1); }, report);
   }
-  return 0;
 }
-/******************** END MAIN ********************/
+/******************** END TUNING ********************/
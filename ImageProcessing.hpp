@@ -1 +1,1645 @@
-
+#ifndef IMAGE_PROCESSING_HPP
+#define IMAGE_PROCESSING_HPP
+
+// The image processing engine: images in memory, the operations on them and
+// the Netpbm codecs. The command line program is built on top of it.
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+class GSCImage;
+
+/******************** MEMORY STATISTICS ********************/
+// Counters of memory use. The counts of allocations are only kept by
+// programs that install allocation hooks and turn `enabled` on.
+struct MemoryStats {
+  std::atomic<bool> enabled{false};
+  std::atomic<uint64_t> allocations{0};
+  std::atomic<uint64_t> allocatedBytes{0};
+  // Pixels of all images, the most there were at once since the peak was
+  // last reset and the most ever
+  std::atomic<int64_t> imageBytes{0};
+  std::atomic<int64_t> peakImageBytes{0};
+  std::atomic<int64_t> highestImageBytes{0};
+  // Estimated pixel traffic: every operation reads its image and writes
+  // its result once, every export reads the image once
+  std::atomic<uint64_t> bytesRead{0};
+  std::atomic<uint64_t> bytesWritten{0};
+
+  void addImage(int64_t bytes) {
+    int64_t total = imageBytes += bytes;
+    for (std::atomic<int64_t> *peak : {&peakImageBytes, &highestImageBytes}) {
+      int64_t seen = *peak;
+      while (total > seen && !peak->compare_exchange_weak(seen, total)) {
+      }
+    }
+  }
+  void removeImage(int64_t bytes) { imageBytes -= bytes; }
+};
+
+extern MemoryStats memoryStats;
+/******************** END MEMORY STATISTICS ********************/
+
+
+/******************** PIXEL CLASS ********************/
+// Pixels have no virtual functions, so rows of them have the layout of raw
+// pixel bytes and images can use buffers of their callers as they are
+class Pixel {};
+/******************** END PIXEL CLASS ********************/
+
+/******************** GSCPIXEL CLASS ********************/
+class GSCPixel : public Pixel {
+private:
+  unsigned char value_;
+
+public:
+  GSCPixel() = default;
+  GSCPixel(const GSCPixel &p) : value_(p.value_) {}
+  GSCPixel(unsigned char value) : value_(value) {}
+
+  unsigned char getValue() { return value_; }
+
+  void setValue(unsigned char value) { value_ = value; }
+};
+/******************** END GSCIMAGE CLASS ********************/
+
+/******************** RGBPIXEL CLASS ********************/
+class RGBPixel : public Pixel {
+private:
+  unsigned char red_;
+  unsigned char green_;
+  unsigned char blue_;
+
+public:
+  RGBPixel() = default;
+  RGBPixel(const RGBPixel &p)
+      : red_(p.red_), green_(p.green_), blue_(p.blue_) {}
+  RGBPixel(unsigned char r, unsigned char g, unsigned char b)
+      : red_(r), green_(g), blue_(b) {}
+
+  unsigned char getRed() const { return red_; }
+
+  unsigned char getGreen() const { return green_; }
+
+  unsigned char getBlue() const { return blue_; }
+
+  void setRed(unsigned char r) { red_ = r; }
+
+  void setGreen(unsigned char g) { green_ = g; }
+
+  void setBlue(unsigned char b) { blue_ = b; }
+};
+static_assert(sizeof(RGBPixel) == 3, "RGBPixel must be 3 raw bytes");
+static_assert(sizeof(GSCPixel) == 1, "GSCPixel must be a raw byte");
+/******************** END RGBPIXEL CLASS********************/
+
+/******************** WARP GEOMETRY ********************/
+// Maps every pixel of a warped image back to the point of the source image
+// it samples, in 16.16 fixed point: pixel (row, col) of the result samples
+// the source at column u0 + row * duRow + col * duCol and row
+// v0 + row * dvRow + col * dvCol, so stepping along a row only adds.
+struct WarpGeometry {
+  int width;
+  int height;
+  int64_t u0;
+  int64_t v0;
+  int64_t duCol;
+  int64_t dvCol;
+  int64_t duRow;
+  int64_t dvRow;
+  bool bilinear;
+
+  // Places the source image, turned by `matrix` (a, b, c, d maps the source
+  // offset x, y from the center to a * x + b * y, c * x + d * y), in the
+  // smallest image that holds it entirely.
+  static WarpGeometry fromMatrix(const double matrix[4], int sourceWidth,
+                                 int sourceHeight, bool bilinear) {
+    WarpGeometry geometry;
+    double halfWidth = sourceWidth / 2.0;
+    double halfHeight = sourceHeight / 2.0;
+    double extentX = std::abs(matrix[0]) * halfWidth +
+                     std::abs(matrix[1]) * halfHeight;
+    double extentY = std::abs(matrix[2]) * halfWidth +
+                     std::abs(matrix[3]) * halfHeight;
+    // Rounding errors of the sines and cosines must not add a pixel
+    geometry.width = static_cast<int>(std::ceil(2 * extentX - 1e-6));
+    geometry.height = static_cast<int>(std::ceil(2 * extentY - 1e-6));
+    geometry.bilinear = bilinear;
+
+    double determinant = matrix[0] * matrix[3] - matrix[1] * matrix[2];
+    double inverse[4] = {matrix[3] / determinant, -matrix[1] / determinant,
+                         -matrix[2] / determinant, matrix[0] / determinant};
+
+    // Pixel centers of the result relative to its center, mapped back and
+    // moved so that 0 is the center of the first source pixel
+    double x = 0.5 - geometry.width / 2.0;
+    double y = 0.5 - geometry.height / 2.0;
+    auto toFixed = [](double value) {
+      return static_cast<int64_t>(std::llround(value * 65536));
+    };
+    geometry.u0 = toFixed(inverse[0] * x + inverse[1] * y + halfWidth - 0.5);
+    geometry.v0 = toFixed(inverse[2] * x + inverse[3] * y + halfHeight - 0.5);
+    geometry.duCol = toFixed(inverse[0]);
+    geometry.duRow = toFixed(inverse[1]);
+    geometry.dvCol = toFixed(inverse[2]);
+    geometry.dvRow = toFixed(inverse[3]);
+    return geometry;
+  }
+};
+/******************** END WARP GEOMETRY ********************/
+
+/******************** IMAGE STATISTICS ********************/
+// Statistics of one channel of the raw pixel rows of an image
+struct ChannelStatistics {
+  int minimum;
+  int maximum;
+  double mean;
+  double standardDeviation;
+  // Number of pixels per value, from 0 to the maximum luminocity
+  std::vector<uint64_t> histogram;
+};
+
+class Image;
+
+// Computes the statistics of every channel of an image: gray, or red, green
+// and blue. Images cache them, see Image::getStatistics().
+std::vector<ChannelStatistics> computeStatistics(const Image &image);
+/******************** END IMAGE STATISTICS ********************/
+
+/******************** IMAGE CLASS ********************/
+// Guards the caches of an image, which tokens sharing the image may fill at
+// the same time. Copies of an image get a mutex of their own.
+class CacheMutex {
+private:
+  std::recursive_mutex mutex;
+
+public:
+  CacheMutex() = default;
+  CacheMutex(const CacheMutex &) {}
+  CacheMutex &operator=(const CacheMutex &) { return *this; }
+  std::recursive_mutex &get() { return mutex; }
+};
+
+class Image {
+protected:
+  int width;
+  int height;
+  int max_luminocity;
+  // Increases with every change of the pixels
+  unsigned long version = 0;
+  // Number of pixels per luma (Y) value, valid while histogramVersion equals
+  // version
+  mutable std::vector<int> lumaHistogram;
+  mutable unsigned long histogramVersion = ~0UL;
+  // Valid while statisticsVersion equals version
+  mutable std::vector<ChannelStatistics> statistics;
+  mutable unsigned long statisticsVersion = ~0UL;
+  // Held while a cache is filled. Changes of the pixels need no lock, as
+  // tokens copy a shared image before changing it.
+  mutable CacheMutex cacheMutex;
+
+  virtual std::vector<int> computeLumaHistogram() const = 0;
+
+  // Marks a change that only moved pixels around, so the histogram and the
+  // statistics still hold
+  void touchKeepingHistogram() {
+    bool histogramValid = histogramVersion == version;
+    bool statisticsValid = statisticsVersion == version;
+    version++;
+    if (histogramValid) {
+      histogramVersion = version;
+    }
+    if (statisticsValid) {
+      statisticsVersion = version;
+    }
+  }
+
+public:
+  Image() = default;
+  // Copies the caches too, taking the lock as another token sharing the
+  // image may be filling them
+  Image(const Image &img)
+      : width(img.width), height(img.height),
+        max_luminocity(img.max_luminocity), version(img.version) {
+    std::lock_guard<std::recursive_mutex> lock(img.cacheMutex.get());
+    lumaHistogram = img.lumaHistogram;
+    histogramVersion = img.histogramVersion;
+    statistics = img.statistics;
+    statisticsVersion = img.statisticsVersion;
+  }
+
+  // Whether a header may give this size: the pixels are allocated before
+  // they are read, so a broken header must not ask for more than exists
+  static bool isValidSize(int width, int height) {
+    const long long maxPixels = 1LL << 28;
+    return width >= 0 && height >= 0 &&
+           static_cast<long long>(width) * height <= maxPixels;
+  }
+
+  // Luma (Y) of a color, between 16 and 235
+  static int getLuma(int red, int green, int blue) {
+    return ((66 * red + 129 * green + 25 * blue + 128) >> 8) + 16;
+  }
+
+  unsigned long getVersion() const { return version; }
+  // Has to be called after changing pixels through getPixel()
+  void touch() { version++; }
+
+  // Histogram of the luma (Y) values, as used for equalization
+  const std::vector<int> &getLumaHistogram() const {
+    std::lock_guard<std::recursive_mutex> lock(cacheMutex.get());
+    if (histogramVersion != version) {
+      lumaHistogram = computeLumaHistogram();
+      histogramVersion = version;
+    }
+    return lumaHistogram;
+  }
+
+  // Histogram of the brightness of the pixels: their values for grayscale
+  // images and their luma for color ones
+  virtual const std::vector<int> &getHistogram() const {
+    return getLumaHistogram();
+  }
+
+  // Statistics of every channel, computed again only after a change
+  const std::vector<ChannelStatistics> &getStatistics() const {
+    std::lock_guard<std::recursive_mutex> lock(cacheMutex.get());
+    if (statisticsVersion != version) {
+      statistics = computeStatistics(*this);
+      statisticsVersion = version;
+    }
+    return statistics;
+  }
+
+  int getWidth() const { return width; }
+  int getHeight() const { return height; }
+  int getMaxLuminocity() const { return max_luminocity; }
+  void setWidth(int width) { this->width = width; }
+  void setHeight(int height) { this->height = height; }
+  void setMaxLuminocity(int lum) { this->max_luminocity = lum; }
+
+  virtual Pixel &getPixel(int row, int col) const = 0;
+  virtual Image &operator+=(int times) = 0;
+  virtual Image &operator*=(double factor) = 0;
+  virtual Image &operator!() = 0;
+  virtual Image &operator~() = 0;
+  virtual Image &operator*() = 0;
+  virtual Image *clone() const = 0;
+  virtual Image *halve() const = 0;
+  // Returns an image of the same kind with the given size and unset pixels
+  virtual Image *createBlank(int width, int height) const = 0;
+  // Returns an image that shows a region of `self`, which has to be this
+  // image, without copying its pixels. A view is never changed: tokens copy
+  // it first, so copying costs only the region.
+  virtual Image *createView(const std::shared_ptr<Image> &self, int left,
+                            int top, int width, int height) const = 0;
+  virtual bool isView() const = 0;
+  // Memory taken by the pixels
+  virtual size_t getPixelBytes() const = 0;
+  // Same as operator+=, but without a second copy of the pixels
+  virtual Image &rotateInPlace(int times) = 0;
+  // Fills rows top to bottom - 1 and columns left to right - 1 with the
+  // pixels of `source`, an image of the same kind, warped by `geometry`.
+  // Pixels that map outside of the source become black.
+  virtual void warpTile(const Image &source, const WarpGeometry &geometry,
+                        int top, int bottom, int left, int right) = 0;
+  // Number of bytes per pixel of the raw pixel rows
+  virtual int getChannels() const = 0;
+  // Copies a row of pixels as raw bytes, red, green and blue for color
+  virtual void getRowBytes(int row, unsigned char *bytes) const = 0;
+  // Overwrites a row of pixels from raw bytes in the same layout. Has to be
+  // followed by touch().
+  virtual void setRowBytes(int row, const unsigned char *bytes) = 0;
+  friend std::ostream &operator<<(std::ostream &out, Image &image);
+  virtual ~Image() = default;
+};
+/******************** END IMAGE CLASS ********************/
+
+/******************** TUNING ********************/
+// Block sizes and thread counts of the blocked kernels, per kernel and kind
+// of image. The defaults suit most machines; calibrate() measures the best
+// ones for this machine.
+enum class TunedKernel { Warp, Filter, RotateInPlace };
+
+struct KernelTuning {
+  // Side of the square tiles, or height of the bands of rows
+  int blockSize;
+  // Threads working on one image, 0 for the whole pool
+  int threads;
+};
+
+// `channels` is 1 for black and white images and 3 for color
+KernelTuning getTuning(TunedKernel kernel, int channels);
+void setTuning(TunedKernel kernel, int channels, const KernelTuning &tuning);
+
+// Reads and writes the tunings as text, one line per kernel and kind of
+// image. A file written on another kind of machine is not loaded.
+bool loadTuning(const std::string &filename);
+bool saveTuning(const std::string &filename);
+
+// Runs short benchmarks of every tuned kernel on generated images, keeps
+// the fastest settings and describes them on `report`. Takes a few seconds.
+void calibrate(std::ostream &report);
+/******************** END TUNING ********************/
+
+/******************** IN-PLACE ROTATION ********************/
+// Rotates clockwise by `times` quarter turns an image whose rows lie one
+// after the other in `block`, without a second image: only the table of
+// rows is allocated again, plus one bit per pixel when turning an image
+// that is not square. `block` is null for rows in memory of someone else,
+// which are never moved: half turns and turns of square images still work
+// on them, the other turns return false without changing anything.
+template <class PixelType>
+bool rotatePixelsInPlace(PixelType *block, PixelType **&rows, int &width,
+                         int &height, int times) {
+  const int tileSize =
+      getTuning(TunedKernel::RotateInPlace, sizeof(PixelType)).blockSize;
+  times = (times % 4 + 4) % 4;
+  if (times == 0 || width == 0 || height == 0) {
+    return true;
+  }
+
+  if (times == 2 && block != nullptr) {
+    // Turning upside down moves pixel i of the block to N - 1 - i
+    std::reverse(block, block + static_cast<size_t>(width) * height);
+    return true;
+  }
+
+  if (times == 2) {
+    // Swap the rows from both ends reversed, then reverse the middle one
+    for (int row = 0; row < height / 2; row++) {
+      std::swap_ranges(rows[row], rows[row] + width,
+                       std::reverse_iterator<PixelType *>(
+                           rows[height - 1 - row] + width));
+    }
+    if (height % 2 == 1) {
+      std::reverse(rows[height / 2], rows[height / 2] + width);
+    }
+    return true;
+  }
+
+  if (width == height) {
+    // Move every four pixels that take each other's places in a turn,
+    // tile by tile so the four rows and columns involved stay in cache
+    const int n = width;
+    for (int tileRow = 0; tileRow < n / 2; tileRow += tileSize) {
+      for (int tileCol = 0; tileCol < (n + 1) / 2; tileCol += tileSize) {
+        for (int r = tileRow; r < std::min(tileRow + tileSize, n / 2); r++) {
+          for (int c = tileCol; c < std::min(tileCol + tileSize, (n + 1) / 2);
+               c++) {
+            PixelType &a = rows[r][c];
+            PixelType &b = rows[c][n - 1 - r];
+            PixelType &d = rows[n - 1 - r][n - 1 - c];
+            PixelType &e = rows[n - 1 - c][r];
+            PixelType carried = a;
+            if (times == 1) {
+              a = e;
+              e = d;
+              d = b;
+              b = carried;
+            } else {
+              a = b;
+              b = d;
+              d = e;
+              e = carried;
+            }
+          }
+        }
+      }
+    }
+    return true;
+  }
+
+  if (block == nullptr) {
+    return false;
+  }
+
+  // Transpose by following the cycles of the permutation: pixel i of the
+  // height x width block goes to i * height mod (N - 1) of the width x
+  // height one. The bitmap marks the pixels already in place.
+  const size_t count = static_cast<size_t>(width) * height;
+  std::vector<bool> moved(count, false);
+  for (size_t start = 1; start + 1 < count; start++) {
+    if (moved[start]) {
+      continue;
+    }
+    PixelType carried = block[start];
+    size_t position = start;
+    do {
+      position = position * height % (count - 1);
+      std::swap(carried, block[position]);
+      moved[position] = true;
+    } while (position != start);
+  }
+
+  std::swap(width, height);
+  delete[] rows;
+  rows = new PixelType *[height];
+  for (int row = 0; row < height; row++) {
+    rows[row] = block + static_cast<size_t>(row) * width;
+  }
+
+  // A clockwise turn is the transpose mirrored left to right, a
+  // counterclockwise one the transpose mirrored top to bottom
+  if (times == 1) {
+    for (int row = 0; row < height; row++) {
+      std::reverse(rows[row], rows[row] + width);
+    }
+  } else {
+    for (int row = 0; row < height / 2; row++) {
+      std::swap_ranges(rows[row], rows[row] + width, rows[height - 1 - row]);
+    }
+  }
+  return true;
+}
+/******************** END IN-PLACE ROTATION ********************/
+
+/******************** RGBImage CLASS ********************/
+class RGBImage : public Image {
+private:
+  RGBPixel **pixels;
+  // Set for a view into memory owned by something else, a region of another
+  // image or a shared memory segment, which it keeps alive. The rows then
+  // point into that memory and are not owned.
+  std::shared_ptr<const void> viewed;
+  // The rows, one after the other, unless this is a view
+  RGBPixel *block = nullptr;
+
+  // Allocates the pixels for the current size as a single block and points
+  // the rows into it
+  void allocatePixels() {
+    block = new RGBPixel[static_cast<size_t>(width) * height];
+    memoryStats.addImage(getPixelBytes());
+    pixels = new RGBPixel *[height];
+    for (int row = 0; row < height; row++) {
+      pixels[row] = block + static_cast<size_t>(row) * width;
+    }
+  }
+
+  void freePixels() {
+    if (block != nullptr) {
+      memoryStats.removeImage(getPixelBytes());
+    }
+    delete[] block;
+    delete[] pixels;
+    block = nullptr;
+    pixels = nullptr;
+    viewed = nullptr;
+  }
+
+public:
+  RGBImage() : pixels(nullptr) {
+    // Initialize the class fields
+    width = 0;
+    height = 0;
+    max_luminocity = 255;
+    pixels = nullptr;
+  }
+
+  RGBImage(const RGBImage &img) : Image(img), pixels(nullptr) {
+    width = img.getWidth();
+    height = img.getHeight();
+    max_luminocity = img.getMaxLuminocity();
+
+    // Allocate memory for pixels
+    allocatePixels();
+    for (int row = 0; row < height; row++) {
+      for (int col = 0; col < width; col++) {
+        pixels[row][col] = img.pixels[row][col];
+      }
+    }
+  }
+  RGBImage(const GSCImage &gsc);
+
+  RGBImage(int Width, int Height) : pixels(nullptr) {
+    width = Width;
+    height = Height;
+    max_luminocity = 255;
+
+    // Allocate memory for pixels
+    allocatePixels();
+    for (int row = 0; row < height; row++) {
+      for (int col = 0; col < width; col++) {
+        pixels[row][col] = RGBPixel();
+      }
+    }
+  }
+
+  RGBImage(std::istream &stream) : pixels(nullptr) {
+    stream >> width >> height >> max_luminocity;
+    if (!stream || !isValidSize(width, height)) {
+      throw std::runtime_error("Invalid image size.");
+    }
+
+    // Allocate memory for pixels
+    allocatePixels();
+    for (int row = 0; row < height; row++) {
+      for (int col = 0; col < width; col++) {
+        int red, green, blue;
+        stream >> red >> green >> blue;
+        pixels[row][col] = RGBPixel(static_cast<unsigned char>(red),
+                                    static_cast<unsigned char>(green),
+                                    static_cast<unsigned char>(blue));
+      }
+    }
+  }
+
+  // Copies the pixels from raw rows of red, green and blue bytes
+  RGBImage(int Width, int Height, int maxLuminocity,
+           const unsigned char *bytes)
+      : pixels(nullptr) {
+    width = Width;
+    height = Height;
+    max_luminocity = maxLuminocity;
+
+    // Allocate memory for pixels
+    allocatePixels();
+    for (int row = 0; row < height; row++) {
+      const unsigned char *rowBytes = bytes + 3 * width * row;
+      for (int col = 0; col < width; col++) {
+        pixels[row][col] = RGBPixel(rowBytes[3 * col], rowBytes[3 * col + 1],
+                                    rowBytes[3 * col + 2]);
+      }
+    }
+  }
+
+  // Uses pixels owned by the caller, rows of red, green and blue bytes that start
+  // `stride` bytes apart, without copying them. Inverting, mirroring,
+  // equalizing and rotating in place by a half turn, or any turn of a square
+  // image, write to these pixels. The other operations, operator+= among
+  // them, move the image to memory of its own. The buffer has to outlive the
+  // image, unless `owner` is given: the image then keeps it alive and is a
+  // view, which tokens copy before changing, so the buffer may be mapped
+  // read-only.
+  static RGBImage *wrap(int Width, int Height, int maxLuminocity,
+                         unsigned char *bytes, size_t stride,
+                         std::shared_ptr<const void> owner = nullptr) {
+    RGBImage *image = new RGBImage();
+    image->setWidth(Width);
+    image->setHeight(Height);
+    image->setMaxLuminocity(maxLuminocity);
+    image->pixels = new RGBPixel *[Height];
+    for (int row = 0; row < Height; row++) {
+      image->pixels[row] = reinterpret_cast<RGBPixel *>(bytes + row * stride);
+    }
+    image->viewed = std::move(owner);
+    return image;
+  }
+
+  virtual int getChannels() const override { return 3; }
+
+  virtual std::vector<int> computeLumaHistogram() const override {
+    std::vector<int> histogram(256, 0);
+    for (int row = 0; row < height; row++) {
+      for (int col = 0; col < width; col++) {
+        const RGBPixel &pixel = pixels[row][col];
+        histogram[getLuma(pixel.getRed(), pixel.getGreen(), pixel.getBlue())]++;
+      }
+    }
+    histogram.resize(236);
+    return histogram;
+  }
+
+  virtual void getRowBytes(int row, unsigned char *bytes) const override {
+    for (int col = 0; col < width; col++) {
+      bytes[3 * col] = pixels[row][col].getRed();
+      bytes[3 * col + 1] = pixels[row][col].getGreen();
+      bytes[3 * col + 2] = pixels[row][col].getBlue();
+    }
+  }
+
+  virtual void setRowBytes(int row, const unsigned char *bytes) override {
+    for (int col = 0; col < width; col++) {
+      pixels[row][col] =
+          RGBPixel(bytes[3 * col], bytes[3 * col + 1], bytes[3 * col + 2]);
+    }
+  }
+
+  virtual RGBPixel &getPixel(int row, int col) const override {
+    if (pixels == nullptr) {
+      throw std::runtime_error("Image is not initialized.");
+    }
+
+    if (row < 0 || row >= height || col < 0 || col >= width) {
+      throw std::out_of_range("Invalid pixel coordinates.");
+    }
+
+    return pixels[row][col];
+  }
+
+  RGBImage &operator=(const RGBImage &img) {
+    if (this == &img) {
+      // Self-assignment check
+      return *this;
+    }
+
+    // Free existing memory
+    freePixels();
+
+    // Assign new dimensions and maximum luminosity
+    width = img.width;
+    height = img.height;
+    max_luminocity = img.max_luminocity;
+    touch();
+
+    // Allocate new memory and copy pixels
+    allocatePixels();
+    for (int row = 0; row < height; row++) {
+      for (int col = 0; col < width; col++) {
+        pixels[row][col] = img.getPixel(row, col);
+      }
+    }
+
+    return *this;
+  }
+
+  virtual Image &operator+=(int times) override {
+    // Calculate the effective rotation times
+    int effectiveTimes = times % 4;
+    if (effectiveTimes < 0)
+      effectiveTimes += 4;
+
+    // Rotating only moves pixels around, so the histogram and the statistics
+    // still hold
+    unsigned long originalVersion = version;
+    bool histogramValid = histogramVersion == version;
+    bool statisticsValid = statisticsVersion == version;
+
+    // Rotate the image clockwise
+    for (int i = 0; i < effectiveTimes; i++) {
+      // Create a temporary image to store the rotated pixels
+      RGBImage rotatedImage;
+      rotatedImage.setWidth(getHeight());
+      rotatedImage.setHeight(getWidth());
+      rotatedImage.setMaxLuminocity(255);
+      rotatedImage.allocatePixels();
+      for (int row = 0; row < rotatedImage.getHeight(); row++) {
+        for (int col = 0; col < rotatedImage.getWidth(); col++) {
+          rotatedImage.pixels[row][col] = RGBPixel();
+        }
+      }
+
+      // Perform the rotation by rearranging the pixels
+      for (int row = 0; row < getHeight(); row++) {
+        for (int col = 0; col < getWidth(); col++) {
+          // Get the pixel from the original image
+          RGBPixel &originalPixel = getPixel(row, col);
+
+          // Calculate the new coordinates for the rotated pixel
+          int rotatedRow = col;
+          int rotatedCol = getHeight() - 1 - row;
+
+          // Get the pixel from the rotated image and assign theoriginal pixel
+          // value
+          RGBPixel &rotatedPixel =
+              rotatedImage.getPixel(rotatedRow, rotatedCol);
+          rotatedPixel = originalPixel;
+        }
+      }
+
+      // Assign the rotated image to the current image
+      *this = rotatedImage;
+      rotatedImage.freePixels();
+    }
+
+    version = originalVersion;
+    if (histogramValid) {
+      histogramVersion = version + 1;
+    }
+    if (statisticsValid) {
+      statisticsVersion = version + 1;
+    }
+    touch();
+    return *this;
+  }
+
+  virtual Image &operator*=(double factor) override {
+    // Calculate the new dimensions based on the factor
+    int newWidth = static_cast<int>(getWidth() * factor);
+    int newHeight = static_cast<int>(getHeight() * factor);
+
+    // Create a temporary image with the new dimensions
+    RGBImage resizedImage;
+    resizedImage.setWidth(newWidth);
+    resizedImage.setHeight(newHeight);
+    resizedImage.setMaxLuminocity(255);
+    resizedImage.allocatePixels();
+    for (int row = 0; row < resizedImage.getHeight(); row++) {
+      for (int col = 0; col < resizedImage.getWidth(); col++) {
+        resizedImage.pixels[row][col] = RGBPixel();
+      }
+    }
+
+    // Scale the pixels from the original image to the resized image
+    for (int row = 0; row < newHeight; row++) {
+      for (int col = 0; col < newWidth; col++) {
+        // Calculate the corresponding coordinates in the original image
+        int r1 = std::min(static_cast<int>(std::floor(row / factor)),
+                          getHeight() - 1);
+        int r2 = std::min(static_cast<int>(std::ceil(row / factor)),
+                          getHeight() - 1);
+        int c1 = std::min(static_cast<int>(std::floor(col / factor)),
+                          getWidth() - 1);
+        int c2 =
+            std::min(static_cast<int>(std::ceil(col / factor)), getWidth() - 1);
+
+        // Get the pixels from the original image
+        RGBPixel &p11 = getPixel(r1, c1);
+        RGBPixel &p12 = getPixel(r1, c2);
+        RGBPixel &p21 = getPixel(r2, c1);
+        RGBPixel &p22 = getPixel(r2, c2);
+
+        // Calculate the average brightness
+        unsigned char avgRedBrightness =
+            (p11.getRed() + p12.getRed() + p21.getRed() + p22.getRed()) / 4;
+        unsigned char avgGreenBrightness = (p11.getGreen() + p12.getGreen() +
+                                            p21.getGreen() + p22.getGreen()) /
+                                           4;
+        unsigned char avgBlueBrightness =
+            (p11.getBlue() + p12.getBlue() + p21.getBlue() + p22.getBlue()) / 4;
+
+        // Set the new pixel in the resized image
+        resizedImage.getPixel(row, col).setRed(avgRedBrightness);
+        resizedImage.getPixel(row, col).setGreen(avgGreenBrightness);
+        resizedImage.getPixel(row, col).setBlue(avgBlueBrightness);
+      }
+    }
+
+    // Assign the resized image to the current image
+    *this = resizedImage;
+    resizedImage.freePixels();
+    return *this;
+  }
+
+  virtual Image &operator!() override {
+    if (pixels == nullptr) {
+      // Image is empty, nothing to invert
+      return *this;
+    }
+
+    // Keep the histogram up to date while at it, if it is in use
+    bool countLuma = histogramVersion == version;
+    std::vector<int> histogram(countLuma ? 256 : 0, 0);
+
+    for (int row = 0; row < height; row++) {
+      for (int col = 0; col < width; col++) {
+        RGBPixel &pixel = getPixel(row, col);
+        unsigned char red = pixel.getRed();
+        unsigned char green = pixel.getGreen();
+        unsigned char blue = pixel.getBlue();
+
+        unsigned char invertedRed = max_luminocity - red;
+        unsigned char invertedGreen = max_luminocity - green;
+        unsigned char invertedBlue = max_luminocity - blue;
+
+        pixel.setRed(invertedRed);
+        pixel.setGreen(invertedGreen);
+        pixel.setBlue(invertedBlue);
+
+        if (countLuma) {
+          histogram[getLuma(invertedRed, invertedGreen, invertedBlue)]++;
+        }
+      }
+    }
+
+    touch();
+    if (countLuma) {
+      histogram.resize(236);
+      lumaHistogram = histogram;
+      histogramVersion = version;
+    }
+    return *this;
+  }
+
+  virtual Image &operator~() override;
+
+  virtual Image &operator*() override {
+    if (pixels == nullptr) {
+      // Image is empty, nothing to reverse
+      return *this;
+    }
+
+    for (int row = 0; row < height; row++) {
+      for (int col = 0; col < width / 2; col++) {
+        std::swap(pixels[row][col], pixels[row][width - 1 - col]);
+      }
+    }
+
+    touchKeepingHistogram();
+    return *this;
+  }
+
+  virtual Image *clone() const override { return new RGBImage(*this); }
+
+  virtual Image *halve() const override {
+    // Average every 2x2 block of the original into one pixel (box filter)
+    RGBImage *halfImage = new RGBImage(width / 2, height / 2);
+    halfImage->setMaxLuminocity(max_luminocity);
+
+    for (int row = 0; row < halfImage->getHeight(); row++) {
+      const RGBPixel *top = pixels[2 * row];
+      const RGBPixel *bottom = pixels[2 * row + 1];
+      for (int col = 0; col < halfImage->getWidth(); col++) {
+        const RGBPixel &p11 = top[2 * col];
+        const RGBPixel &p12 = top[2 * col + 1];
+        const RGBPixel &p21 = bottom[2 * col];
+        const RGBPixel &p22 = bottom[2 * col + 1];
+
+        halfImage->pixels[row][col] = RGBPixel(
+            (p11.getRed() + p12.getRed() + p21.getRed() + p22.getRed() + 2) /
+                4,
+            (p11.getGreen() + p12.getGreen() + p21.getGreen() +
+             p22.getGreen() + 2) /
+                4,
+            (p11.getBlue() + p12.getBlue() + p21.getBlue() + p22.getBlue() +
+             2) /
+                4);
+      }
+    }
+
+    return halfImage;
+  }
+
+  virtual Image *createView(const std::shared_ptr<Image> &self, int left,
+                            int top, int Width, int Height) const override {
+    RGBImage *view = new RGBImage();
+    view->setWidth(Width);
+    view->setHeight(Height);
+    view->setMaxLuminocity(max_luminocity);
+    view->pixels = new RGBPixel *[Height];
+    for (int row = 0; row < Height; row++) {
+      view->pixels[row] = pixels[top + row] + left;
+    }
+    view->viewed = self;
+    return view;
+  }
+
+  virtual bool isView() const override { return viewed != nullptr; }
+
+  virtual size_t getPixelBytes() const override {
+    return static_cast<size_t>(width) * height * sizeof(RGBPixel);
+  }
+
+  virtual Image &rotateInPlace(int times) override {
+    if (!rotatePixelsInPlace(block, pixels, width, height, times)) {
+      return *this += times;
+    }
+    touchKeepingHistogram();
+    return *this;
+  }
+
+  virtual Image *createBlank(int Width, int Height) const override {
+    RGBImage *image = new RGBImage();
+    image->setWidth(Width);
+    image->setHeight(Height);
+    image->setMaxLuminocity(max_luminocity);
+    image->allocatePixels();
+    return image;
+  }
+
+  virtual void warpTile(const Image &image, const WarpGeometry &geometry,
+                        int top, int bottom, int left, int right) override {
+    const RGBImage &source = static_cast<const RGBImage &>(image);
+    // Points within half a pixel of the source are inside it
+    const int64_t lastU = (static_cast<int64_t>(source.width) << 16) - 0x8000;
+    const int64_t lastV = (static_cast<int64_t>(source.height) << 16) - 0x8000;
+
+    for (int row = top; row < bottom; row++) {
+      int64_t u = geometry.u0 + row * geometry.duRow + left * geometry.duCol;
+      int64_t v = geometry.v0 + row * geometry.dvRow + left * geometry.dvCol;
+      RGBPixel *target = pixels[row];
+
+      for (int col = left; col < right;
+           col++, u += geometry.duCol, v += geometry.dvCol) {
+        if (u < -0x8000 || u >= lastU || v < -0x8000 || v >= lastV) {
+          target[col] = RGBPixel(0, 0, 0);
+          continue;
+        }
+
+        if (!geometry.bilinear) {
+          target[col] = source.pixels[(v + 0x8000) >> 16][(u + 0x8000) >> 16];
+          continue;
+        }
+
+        // Blend the four nearest pixels with 8 bit weights, repeating the
+        // edge pixels along the border
+        int col0 = std::max(static_cast<int>(u >> 16), 0);
+        int col1 = std::min(static_cast<int>(u >> 16) + 1, source.width - 1);
+        int row0 = std::max(static_cast<int>(v >> 16), 0);
+        int row1 = std::min(static_cast<int>(v >> 16) + 1, source.height - 1);
+        int fractionU = (u >> 8) & 0xFF;
+        int fractionV = (v >> 8) & 0xFF;
+        const RGBPixel &p11 = source.pixels[row0][col0];
+        const RGBPixel &p12 = source.pixels[row0][col1];
+        const RGBPixel &p21 = source.pixels[row1][col0];
+        const RGBPixel &p22 = source.pixels[row1][col1];
+        auto blend = [&](int c11, int c12, int c21, int c22) {
+          int upper = c11 * (256 - fractionU) + c12 * fractionU;
+          int lower = c21 * (256 - fractionU) + c22 * fractionU;
+          return static_cast<unsigned char>(
+              (upper * (256 - fractionV) + lower * fractionV + 0x8000) >> 16);
+        };
+        target[col] = RGBPixel(
+            blend(p11.getRed(), p12.getRed(), p21.getRed(), p22.getRed()),
+            blend(p11.getGreen(), p12.getGreen(), p21.getGreen(),
+                  p22.getGreen()),
+            blend(p11.getBlue(), p12.getBlue(), p21.getBlue(), p22.getBlue()));
+      }
+    }
+  }
+
+  friend std::ostream &operator<<(std::ostream &out, Image &image);
+
+  ~RGBImage() {
+    // Free the memory allocated for the pixels
+    freePixels();
+  }
+};
+/******************** END RGBIMAGE CLASS********************/
+
+/******************** GSCImage CLASS ********************/
+class GSCImage : public Image {
+private:
+  GSCPixel **pixels;
+  // Set for a view into memory owned by something else, a region of another
+  // image or a shared memory segment, which it keeps alive. The rows then
+  // point into that memory and are not owned.
+  std::shared_ptr<const void> viewed;
+  // The rows, one after the other, unless this is a view
+  GSCPixel *block = nullptr;
+
+  // Allocates the pixels for the current size as a single block and points
+  // the rows into it
+  void allocatePixels() {
+    block = new GSCPixel[static_cast<size_t>(width) * height];
+    memoryStats.addImage(getPixelBytes());
+    pixels = new GSCPixel *[height];
+    for (int row = 0; row < height; row++) {
+      pixels[row] = block + static_cast<size_t>(row) * width;
+    }
+  }
+
+  void freePixels() {
+    if (block != nullptr) {
+      memoryStats.removeImage(getPixelBytes());
+    }
+    delete[] block;
+    delete[] pixels;
+    block = nullptr;
+    pixels = nullptr;
+    viewed = nullptr;
+  }
+  // Number of pixels per value, valid while valueHistogramVersion equals
+  // version
+  mutable std::vector<int> valueHistogram;
+  mutable unsigned long valueHistogramVersion = ~0UL;
+
+  const std::vector<int> &getValueHistogram() const {
+    std::lock_guard<std::recursive_mutex> lock(cacheMutex.get());
+    if (valueHistogramVersion != version) {
+      valueHistogram.assign(256, 0);
+      for (int row = 0; row < height; row++) {
+        for (int col = 0; col < width; col++) {
+          valueHistogram[pixels[row][col].getValue()]++;
+        }
+      }
+      valueHistogramVersion = version;
+    }
+    return valueHistogram;
+  }
+
+  // Moving pixels around keeps the histogram of the values as well
+  void touchKeepingHistogram() {
+    bool valueHistogramValid = valueHistogramVersion == version;
+    Image::touchKeepingHistogram();
+    if (valueHistogramValid) {
+      valueHistogramVersion = version;
+    }
+  }
+
+public:
+  GSCImage() : pixels(nullptr) {
+    // Initialize the class fields
+    width = 0;
+    height = 0;
+    max_luminocity = 255;
+    pixels = nullptr;
+  }
+
+  GSCImage(const GSCImage &img)
+      : Image(img), pixels(nullptr) {
+    {
+      std::lock_guard<std::recursive_mutex> lock(img.cacheMutex.get());
+      valueHistogram = img.valueHistogram;
+      valueHistogramVersion = img.valueHistogramVersion;
+    }
+    width = img.getWidth();
+    height = img.getHeight();
+    max_luminocity = img.getMaxLuminocity();
+
+    // Allocate memory for pixels
+    allocatePixels();
+    for (int row = 0; row < height; row++) {
+      for (int col = 0; col < width; col++) {
+        pixels[row][col] = img.pixels[row][col];
+      }
+    }
+  }
+
+  GSCImage(const RGBImage &rgb) : pixels(nullptr), valueHistogram(256, 0) {
+    width = rgb.getWidth();
+    height = rgb.getHeight();
+    max_luminocity = rgb.getMaxLuminocity();
+
+    // Allocate memory for pixels
+    allocatePixels();
+    for (int row = 0; row < height; row++) {
+      for (int col = 0; col < width; col++) {
+        const RGBPixel &rgbPixel = rgb.getPixel(row, col);
+        unsigned char grayValue = static_cast<unsigned char>(
+            rgbPixel.getRed() * 0.3 + rgbPixel.getGreen() * 0.59 +
+            rgbPixel.getBlue() * 0.11);
+        pixels[row][col] = GSCPixel(grayValue);
+        valueHistogram[grayValue]++;
+      }
+    }
+    valueHistogramVersion = version;
+  }
+
+  GSCImage(std::istream &stream) : pixels(nullptr) {
+    stream >> width >> height >> max_luminocity;
+    if (!stream || !isValidSize(width, height)) {
+      throw std::runtime_error("Invalid image size.");
+    }
+
+    // Allocate memory for pixels
+    allocatePixels();
+    for (int row = 0; row < height; row++) {
+      for (int col = 0; col < width; col++) {
+        int pixelValue;
+        stream >> pixelValue;
+        pixels[row][col] = GSCPixel(static_cast<unsigned char>(pixelValue));
+      }
+    }
+  }
+
+  // Copies the pixels from raw rows of bytes
+  GSCImage(int Width, int Height, int maxLuminocity,
+           const unsigned char *bytes)
+      : pixels(nullptr) {
+    width = Width;
+    height = Height;
+    max_luminocity = maxLuminocity;
+
+    // Allocate memory for pixels
+    allocatePixels();
+    for (int row = 0; row < height; row++) {
+      for (int col = 0; col < width; col++) {
+        pixels[row][col] = GSCPixel(bytes[width * row + col]);
+      }
+    }
+  }
+
+  // Uses pixels owned by the caller, rows of bytes that start
+  // `stride` bytes apart, without copying them. Inverting, mirroring,
+  // equalizing and rotating in place by a half turn, or any turn of a square
+  // image, write to these pixels. The other operations, operator+= among
+  // them, move the image to memory of its own. The buffer has to outlive the
+  // image, unless `owner` is given: the image then keeps it alive and is a
+  // view, which tokens copy before changing, so the buffer may be mapped
+  // read-only.
+  static GSCImage *wrap(int Width, int Height, int maxLuminocity,
+                         unsigned char *bytes, size_t stride,
+                         std::shared_ptr<const void> owner = nullptr) {
+    GSCImage *image = new GSCImage();
+    image->setWidth(Width);
+    image->setHeight(Height);
+    image->setMaxLuminocity(maxLuminocity);
+    image->pixels = new GSCPixel *[Height];
+    for (int row = 0; row < Height; row++) {
+      image->pixels[row] = reinterpret_cast<GSCPixel *>(bytes + row * stride);
+    }
+    image->viewed = std::move(owner);
+    return image;
+  }
+
+  virtual int getChannels() const override { return 1; }
+
+  virtual std::vector<int> computeLumaHistogram() const override {
+    // Every value is a gray color with a single luma
+    const std::vector<int> &values = getValueHistogram();
+    std::vector<int> histogram(236, 0);
+    for (int value = 0; value < 256; value++) {
+      histogram[getLuma(value, value, value)] += values[value];
+    }
+    return histogram;
+  }
+
+  virtual const std::vector<int> &getHistogram() const override {
+    return getValueHistogram();
+  }
+
+  virtual void getRowBytes(int row, unsigned char *bytes) const override {
+    for (int col = 0; col < width; col++) {
+      bytes[col] = pixels[row][col].getValue();
+    }
+  }
+
+  virtual void setRowBytes(int row, const unsigned char *bytes) override {
+    for (int col = 0; col < width; col++) {
+      pixels[row][col] = GSCPixel(bytes[col]);
+    }
+  }
+
+  virtual GSCPixel &getPixel(int row, int col) const override {
+    if (pixels == nullptr) {
+      throw std::runtime_error("Image is not initialized.");
+    }
+
+    if (row < 0 || row >= height || col < 0 || col >= width) {
+      throw std::out_of_range("Invalid pixel coordinates.");
+    }
+
+    return pixels[row][col];
+  }
+
+  virtual Image &operator+=(int times) override {
+    // Calculate the effective rotation times
+    int effectiveTimes = times % 4;
+    if (effectiveTimes < 0)
+      effectiveTimes += 4;
+
+    // Rotating only moves pixels around, so the histogram and the statistics
+    // still hold
+    unsigned long originalVersion = version;
+    bool histogramValid = histogramVersion == version;
+    bool statisticsValid = statisticsVersion == version;
+    bool valueHistogramValid = valueHistogramVersion == version;
+
+    // Rotate the image clockwise
+    for (int i = 0; i < effectiveTimes; i++) {
+      // Create a temporary image to store the rotated pixels
+      GSCImage rotatedImage;
+      rotatedImage.setWidth(getHeight());
+      rotatedImage.setHeight(getWidth());
+      rotatedImage.setMaxLuminocity(255);
+      rotatedImage.allocatePixels();
+      for (int row = 0; row < rotatedImage.getHeight(); row++) {
+        for (int col = 0; col < rotatedImage.getWidth(); col++) {
+          rotatedImage.pixels[row][col] = GSCPixel();
+        }
+      }
+
+      // Perform the rotation by rearranging the pixels
+      for (int row = 0; row < getHeight(); row++) {
+        for (int col = 0; col < getWidth(); col++) {
+          // Get the pixel from the original image
+          GSCPixel &originalPixel = getPixel(row, col);
+
+          // Calculate the new coordinates for the rotated pixel
+          int rotatedRow = col;
+          int rotatedCol = getHeight() - 1 - row;
+
+          // Get the pixel from the rotated image and assign theoriginal pixel
+          // value
+          GSCPixel &rotatedPixel =
+              rotatedImage.getPixel(rotatedRow, rotatedCol);
+          rotatedPixel = originalPixel;
+        }
+      }
+
+      // Assign the rotated image to the current image
+      *this = rotatedImage;
+      rotatedImage.freePixels();
+    }
+
+    version = originalVersion;
+    if (histogramValid) {
+      histogramVersion = version + 1;
+    }
+    if (statisticsValid) {
+      statisticsVersion = version + 1;
+    }
+    if (valueHistogramValid) {
+      valueHistogramVersion = version + 1;
+    }
+    touch();
+    return *this;
+  }
+
+  virtual Image &operator*=(double factor) override {
+    // Calculate the new dimensions based on the factor
+    int newWidth = static_cast<int>(getWidth() * factor);
+    int newHeight = static_cast<int>(getHeight() * factor);
+
+    // Create a temporary image with the new dimensions
+    GSCImage resizedImage;
+    resizedImage.setWidth(newWidth);
+    resizedImage.setHeight(newHeight);
+    resizedImage.setMaxLuminocity(255);
+    resizedImage.allocatePixels();
+    for (int row = 0; row < resizedImage.getHeight(); row++) {
+      for (int col = 0; col < resizedImage.getWidth(); col++) {
+        resizedImage.pixels[row][col] = GSCPixel();
+      }
+    }
+
+    // Scale the pixels from the original image to the resized image
+    for (int row = 0; row < newHeight; row++) {
+      for (int col = 0; col < newWidth; col++) {
+        // Calculate the corresponding coordinates in the original image
+        int r1 = std::min(static_cast<int>(std::floor(row / factor)),
+                          getHeight() - 1);
+        int r2 = std::min(static_cast<int>(std::ceil(row / factor)),
+                          getHeight() - 1);
+        int c1 = std::min(static_cast<int>(std::floor(col / factor)),
+                          getWidth() - 1);
+        int c2 =
+            std::min(static_cast<int>(std::ceil(col / factor)), getWidth() - 1);
+
+        // Get the pixels from the original image
+        GSCPixel &p11 = getPixel(r1, c1);
+        GSCPixel &p12 = getPixel(r1, c2);
+        GSCPixel &p21 = getPixel(r2, c1);
+        GSCPixel &p22 = getPixel(r2, c2);
+
+        // Calculate the average brightness
+        unsigned char avgBrightness = (p11.getValue() + p12.getValue() +
+                                       p21.getValue() + p22.getValue()) /
+                                      4;
+
+        // Set the new pixel in the resized image
+        GSCPixel &resizedPixel = resizedImage.getPixel(row, col);
+        resizedPixel.setValue(avgBrightness);
+      }
+    }
+
+    // Assign the resized image to the current image
+    *this = resizedImage;
+    resizedImage.freePixels();
+    return *this;
+  }
+
+  virtual Image &operator!() override {
+    if (pixels == nullptr) {
+      // Image is empty, nothing to invert
+      return *this;
+    }
+
+    for (int row = 0; row < height; row++) {
+      for (int col = 0; col < width; col++) {
+        GSCPixel &pixel = getPixel(row, col);
+        unsigned char currentLuminosity = pixel.getValue();
+        unsigned char invertedLuminosity = max_luminocity - currentLuminosity;
+        pixel.setValue(invertedLuminosity);
+      }
+    }
+
+    // Every value moved to its inverse, so does its count
+    bool histogramValid = valueHistogramVersion == version;
+    touch();
+    if (histogramValid) {
+      std::vector<int> inverted(256, 0);
+      for (int value = 0; value < 256; value++) {
+        inverted[static_cast<unsigned char>(max_luminocity - value)] +=
+            valueHistogram[value];
+      }
+      valueHistogram = inverted;
+      valueHistogramVersion = version;
+    }
+    return *this;
+  }
+
+  virtual Image &operator*() override {
+    if (pixels == nullptr) {
+      // Image is empty, nothing to reverse
+      return *this;
+    }
+
+    for (int row = 0; row < height; row++) {
+      for (int col = 0; col < width / 2; col++) {
+        std::swap(pixels[row][col], pixels[row][width - 1 - col]);
+      }
+    }
+
+    touchKeepingHistogram();
+    return *this;
+  }
+
+  GSCImage &operator=(const GSCImage &img) {
+    if (this == &img) {
+      // Self-assignment check
+      return *this;
+    }
+
+    // Free existing memory
+    freePixels();
+
+    // Assign new dimensions and maximum luminosity
+    width = img.width;
+    height = img.height;
+    max_luminocity = img.max_luminocity;
+    touch();
+
+    // Allocate new memory and copy pixels
+    allocatePixels();
+    for (int row = 0; row < height; row++) {
+      for (int col = 0; col < width; col++) {
+        pixels[row][col] = img.getPixel(row, col);
+      }
+    }
+
+    return *this;
+  }
+
+  virtual Image &operator~() override;
+
+  virtual Image *clone() const override { return new GSCImage(*this); }
+
+  virtual Image *halve() const override {
+    // Average every 2x2 block of the original into one pixel (box filter)
+    GSCImage *halfImage = new GSCImage();
+    halfImage->setWidth(width / 2);
+    halfImage->setHeight(height / 2);
+    halfImage->setMaxLuminocity(max_luminocity);
+    halfImage->allocatePixels();
+
+    for (int row = 0; row < halfImage->getHeight(); row++) {
+      GSCPixel *top = pixels[2 * row];
+      GSCPixel *bottom = pixels[2 * row + 1];
+      for (int col = 0; col < halfImage->getWidth(); col++) {
+        int sum = top[2 * col].getValue() + top[2 * col + 1].getValue() +
+                  bottom[2 * col].getValue() + bottom[2 * col + 1].getValue();
+        halfImage->pixels[row][col] = GSCPixel((sum + 2) / 4);
+      }
+    }
+
+    return halfImage;
+  }
+
+  virtual Image *createView(const std::shared_ptr<Image> &self, int left,
+                            int top, int Width, int Height) const override {
+    GSCImage *view = new GSCImage();
+    view->setWidth(Width);
+    view->setHeight(Height);
+    view->setMaxLuminocity(max_luminocity);
+    view->pixels = new GSCPixel *[Height];
+    for (int row = 0; row < Height; row++) {
+      view->pixels[row] = pixels[top + row] + left;
+    }
+    view->viewed = self;
+    return view;
+  }
+
+  virtual bool isView() const override { return viewed != nullptr; }
+
+  virtual size_t getPixelBytes() const override {
+    return static_cast<size_t>(width) * height * sizeof(GSCPixel);
+  }
+
+  virtual Image &rotateInPlace(int times) override {
+    if (!rotatePixelsInPlace(block, pixels, width, height, times)) {
+      return *this += times;
+    }
+    touchKeepingHistogram();
+    return *this;
+  }
+
+  virtual Image *createBlank(int Width, int Height) const override {
+    GSCImage *image = new GSCImage();
+    image->setWidth(Width);
+    image->setHeight(Height);
+    image->setMaxLuminocity(max_luminocity);
+    image->allocatePixels();
+    return image;
+  }
+
+  virtual void warpTile(const Image &image, const WarpGeometry &geometry,
+                        int top, int bottom, int left, int right) override {
+    const GSCImage &source = static_cast<const GSCImage &>(image);
+    // Points within half a pixel of the source are inside it
+    const int64_t lastU = (static_cast<int64_t>(source.width) << 16) - 0x8000;
+    const int64_t lastV = (static_cast<int64_t>(source.height) << 16) - 0x8000;
+
+    for (int row = top; row < bottom; row++) {
+      int64_t u = geometry.u0 + row * geometry.duRow + left * geometry.duCol;
+      int64_t v = geometry.v0 + row * geometry.dvRow + left * geometry.dvCol;
+      GSCPixel *target = pixels[row];
+
+      for (int col = left; col < right;
+           col++, u += geometry.duCol, v += geometry.dvCol) {
+        if (u < -0x8000 || u >= lastU || v < -0x8000 || v >= lastV) {
+          target[col] = GSCPixel(0);
+          continue;
+        }
+
+        if (!geometry.bilinear) {
+          target[col] = source.pixels[(v + 0x8000) >> 16][(u + 0x8000) >> 16];
+          continue;
+        }
+
+        // Blend the four nearest pixels with 8 bit weights, repeating the
+        // edge pixels along the border
+        int col0 = std::max(static_cast<int>(u >> 16), 0);
+        int col1 = std::min(static_cast<int>(u >> 16) + 1, source.width - 1);
+        int row0 = std::max(static_cast<int>(v >> 16), 0);
+        int row1 = std::min(static_cast<int>(v >> 16) + 1, source.height - 1);
+        int fractionU = (u >> 8) & 0xFF;
+        int fractionV = (v >> 8) & 0xFF;
+        int upper = source.pixels[row0][col0].getValue() * (256 - fractionU) +
+                    source.pixels[row0][col1].getValue() * fractionU;
+        int lower = source.pixels[row1][col0].getValue() * (256 - fractionU) +
+                    source.pixels[row1][col1].getValue() * fractionU;
+        target[col] = GSCPixel(static_cast<unsigned char>(
+            (upper * (256 - fractionV) + lower * fractionV + 0x8000) >> 16));
+      }
+    }
+  }
+
+  friend std::ostream &operator<<(std::ostream &out, Image &image);
+
+  ~GSCImage() {
+    // Free the memory allocated for the pixels
+    freePixels();
+  }
+};
+/******************** END GSCIMAGE CLASS ********************/
+
+
+/******************** PROFILER ********************/
+// Hardware performance counters (perf_event_open) of every thread that runs
+// operations, summed over the threads. Counters that the machine does not
+// have are marked as unavailable.
+class Profiler {
+public:
+  enum Event {
+    TaskClock,
+    Cycles,
+    Instructions,
+    L1Misses,
+    LLCMisses,
+    BranchMisses,
+    EventCount
+  };
+
+  struct Counts {
+    double values[EventCount] = {};
+    bool available[EventCount] = {};
+    // Pixels processed while counting, for the rates per pixel
+    uint64_t pixels = 0;
+  };
+
+  // Starts counting on the calling thread and on every pool thread. Returns
+  // false if no counter can be opened at all.
+  static bool enable();
+  static bool isEnabled();
+  // Starts counting on the calling thread, if it does not count already
+  static void attachThread();
+  static Counts read();
+  static Counts difference(const Counts &end, const Counts &start);
+  static std::string describe(const Counts &counts);
+
+  // Kernels measured by ProfileScope since the last call, in order
+  static void recordKernel(const std::string &name, const Counts &counts);
+  static std::vector<std::pair<std::string, Counts>> takeKernels();
+};
+
+// Measures a kernel from construction to destruction while profiling
+class ProfileScope {
+private:
+  std::string name;
+  Profiler::Counts start;
+  uint64_t pixels;
+
+public:
+  ProfileScope(const std::string &kernelName, uint64_t pixelCount);
+  void setPixels(uint64_t pixelCount) { pixels = pixelCount; }
+  ~ProfileScope();
+};
+/******************** END PROFILER ********************/
+
+/******************** THREAD POOL CLASS ********************/
+// Work-stealing pool. Every worker owns a task queue: tasks submitted from a
+// worker go to the back of its own queue and are run from there, idle
+// workers steal from the front of the other queues.
+class ThreadPool {
+private:
+  struct TaskQueue {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  std::vector<std::unique_ptr<TaskQueue>> queues;
+  std::vector<std::thread> workers;
+  std::mutex sleepMutex;
+  std::condition_variable wakeUp;
+  std::atomic<int> queuedTasks;
+  std::atomic<unsigned> nextQueue;
+  bool stopping;
+
+  static thread_local ThreadPool *currentPool;
+  static thread_local int currentWorker;
+
+  bool runNextTask(int worker);
+  void workerLoop(int worker);
+
+public:
+  explicit ThreadPool(int threadCount);
+  int getThreadCount() const { return static_cast<int>(workers.size()); }
+  void submit(std::function<void()> task);
+  void parallelFor(int count, const std::function<void(int)> &body,
+                   int maxThreads = 0);
+  ~ThreadPool();
+};
+
+// Sets the number of threads of the pool shared by the operations. Only
+// has an effect before the first operation that runs in parallel.
+void setThreadCount(int threadCount);
+ThreadPool &getThreadPool();
+/******************** END THREAD POOL CLASS ********************/
+
+/******************** CODECS ********************/
+// Parses an image in the P3 (color) or P2 (black and white) Netpbm format.
+// Returns nullptr for other formats.
+Image *readNetpbmImage(std::istream &f);
+
+// Writes an image in the P3 or P2 Netpbm format
+std::ostream &operator<<(std::ostream &out, Image &image);
+/******************** END CODECS ********************/
+
+/******************** WARP ********************/
+// Fills `matrix` with the affine matrix that scales by `factor`, shears
+// horizontally by `shearX` and vertically by `shearY`, then rotates
+// clockwise by `degrees`
+void buildAffineMatrix(double degrees, double shearX, double shearY,
+                       double factor, double matrix[4]);
+
+// Returns a new image with the image warped by `matrix` (see WarpGeometry),
+// blending neighbouring pixels if `bilinear` is set
+Image *warp(const Image &image, const double matrix[4], bool bilinear);
+/******************** END WARP ********************/
+
+/******************** CONVOLUTION ********************/
+enum class FilterType { Box, Blur, Sharpen, Edge };
+enum class BorderMode { Clamp, Mirror, Zero };
+
+// The samples of an image, channels interleaved as in its raw rows and
+// widened to int so results between passes may be negative or above 255
+struct SamplePlane {
+  int width;
+  int height;
+  int channels;
+  std::vector<int> samples;
+
+  int *row(int index) {
+    return samples.data() + static_cast<size_t>(index) * width * channels;
+  }
+  const int *row(int index) const {
+    return samples.data() + static_cast<size_t>(index) * width * channels;
+  }
+};
+
+// A 2-D filter that is the product of a horizontal and a vertical 1-D
+// kernel with an odd number of integer weights. The sums are divided by
+// `divisor` once at the end, so the result equals the 2-D convolution.
+struct SeparableKernel {
+  std::vector<int> horizontal;
+  std::vector<int> vertical;
+  int divisor;
+  // All weights are 1, so running sums replace the multiplications
+  bool box;
+};
+
+SeparableKernel boxKernel(int radius);
+SeparableKernel gaussianKernel(int radius);
+
+// Convolves with a separable kernel, in parallel
+SamplePlane convolveSeparable(const SamplePlane &source,
+                              const SeparableKernel &kernel,
+                              BorderMode border);
+// The same result with the full 2-D kernel, for reference
+SamplePlane convolveNaive(const SamplePlane &source,
+                          const SeparableKernel &kernel, BorderMode border);
+SamplePlane blur(const SamplePlane &source, int radius, BorderMode border);
+
+SamplePlane toSamplePlane(const Image &image);
+void fromSamplePlane(const SamplePlane &plane, Image &image);
+
+// Runs a filter of the given radius (1 to 100) on the image
+void filterImage(Image &image, FilterType type, int radius, BorderMode border);
+/******************** END CONVOLUTION ********************/
+
+#endif
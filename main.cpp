@@ -0,0 +1,3083 @@
+#include "ImageProcessing.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <glob.h>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <malloc.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <pthread.h>
+#include <shared_mutex>
+#include <signal.h>
+#include <sstream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+/******************** ALLOCATION HOOKS ********************/
+// Every allocation of the program goes through these, so they can be
+// counted
+void *countedAllocation(size_t size) {
+  void *block = std::malloc(size == 0 ? 1 : size);
+  if (block == nullptr) {
+    throw std::bad_alloc();
+  }
+  if (memoryStats.enabled.load(std::memory_order_relaxed)) {
+    memoryStats.allocations++;
+    memoryStats.allocatedBytes += malloc_usable_size(block);
+  }
+  return block;
+}
+
+void *operator new(size_t size) { return countedAllocation(size); }
+void *operator new[](size_t size) { return countedAllocation(size); }
+void operator delete(void *block) noexcept { std::free(block); }
+void operator delete[](void *block) noexcept { std::free(block); }
+void operator delete(void *block, size_t) noexcept { std::free(block); }
+void operator delete[](void *block, size_t) noexcept { std::free(block); }
+/******************** END ALLOCATION HOOKS ********************/
+
+/******************** IMPORT CACHE CLASS ********************/
+// Size and hash of the contents of an imported file
+typedef std::pair<uint64_t, size_t> ContentKey;
+
+// xxHash64 of a block of memory
+uint64_t hashBytes(const char *data, size_t length) {
+  const uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+  const uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+  const uint64_t prime3 = 0x165667B19E3779F9ULL;
+  const uint64_t prime4 = 0x85EBCA77C2B2AE63ULL;
+  const uint64_t prime5 = 0x27D4EB2F165667C5ULL;
+
+  auto rotateLeft = [](uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+  };
+  auto read64 = [](const char *p) {
+    uint64_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+  };
+  auto round = [&](uint64_t accumulator, uint64_t input) {
+    accumulator += input * prime2;
+    return rotateLeft(accumulator, 31) * prime1;
+  };
+  auto merge = [&](uint64_t accumulator, uint64_t lane) {
+    accumulator ^= round(0, lane);
+    return accumulator * prime1 + prime4;
+  };
+
+  const char *p = data;
+  const char *end = data + length;
+  uint64_t hash;
+
+  if (length >= 32) {
+    uint64_t lane1 = prime1 + prime2;
+    uint64_t lane2 = prime2;
+    uint64_t lane3 = 0;
+    uint64_t lane4 = 0 - prime1;
+    for (; p + 32 <= end; p += 32) {
+      lane1 = round(lane1, read64(p));
+      lane2 = round(lane2, read64(p + 8));
+      lane3 = round(lane3, read64(p + 16));
+      lane4 = round(lane4, read64(p + 24));
+    }
+    hash = rotateLeft(lane1, 1) + rotateLeft(lane2, 7) +
+           rotateLeft(lane3, 12) + rotateLeft(lane4, 18);
+    hash = merge(hash, lane1);
+    hash = merge(hash, lane2);
+    hash = merge(hash, lane3);
+    hash = merge(hash, lane4);
+  } else {
+    hash = prime5;
+  }
+
+  hash += length;
+  for (; p + 8 <= end; p += 8) {
+    hash ^= round(0, read64(p));
+    hash = rotateLeft(hash, 27) * prime1 + prime4;
+  }
+  if (p + 4 <= end) {
+    uint32_t word;
+    std::memcpy(&word, p, sizeof(word));
+    hash ^= static_cast<uint64_t>(word) * prime1;
+    hash = rotateLeft(hash, 23) * prime2 + prime3;
+    p += 4;
+  }
+  for (; p < end; p++) {
+    hash ^= static_cast<unsigned char>(*p) * prime5;
+    hash = rotateLeft(hash, 11) * prime1;
+  }
+
+  hash ^= hash >> 33;
+  hash *= prime2;
+  hash ^= hash >> 29;
+  hash *= prime3;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+// Images decoded by earlier imports, indexed by the contents of their file.
+// Importing the same contents again shares the decoded image instead of
+// parsing it; tokens copy a shared image before they modify it. Only images
+// that still match their file are listed, so a token that owns its image
+// alone takes it out of the cache before modifying it in place.
+class ImportCache {
+private:
+  struct Entry {
+    std::weak_ptr<Image> image;
+    double parseSeconds;
+    bool parsing;
+  };
+
+  std::map<ContentKey, Entry> entries;
+  std::mutex mutex;
+  std::condition_variable parsed;
+  int hits;
+  size_t bytesSaved;
+  double secondsSaved;
+
+public:
+  ImportCache() : hits(0), bytesSaved(0), secondsSaved(0) {}
+  std::shared_ptr<Image> find(const ContentKey &key);
+  void add(const ContentKey &key, const std::shared_ptr<Image> &image,
+           double parseSeconds);
+  void forget(const ContentKey &key, const Image *image);
+  void printSummary(std::ostream &out);
+};
+
+// Returns the image decoded from the same contents, waiting for it if
+// another import is still parsing them. Returns nullptr if there is none,
+// in which case the caller has to parse the contents and add() the result.
+std::shared_ptr<Image> ImportCache::find(const ContentKey &key) {
+  std::unique_lock<std::mutex> lock(mutex);
+  auto it = entries.find(key);
+  while (it != entries.end() && it->second.parsing) {
+    parsed.wait(lock);
+    it = entries.find(key);
+  }
+
+  std::shared_ptr<Image> image;
+  if (it != entries.end()) {
+    image = it->second.image.lock();
+  }
+  if (!image) {
+    entries[key] = Entry{std::weak_ptr<Image>(), 0, true};
+    return nullptr;
+  }
+
+  hits++;
+  bytesSaved += key.second;
+  secondsSaved += it->second.parseSeconds;
+  return image;
+}
+
+// Publishes the image parsed after find() returned nullptr; nullptr if the
+// contents could not be parsed.
+void ImportCache::add(const ContentKey &key,
+                      const std::shared_ptr<Image> &image,
+                      double parseSeconds) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (image) {
+      entries[key] = Entry{image, parseSeconds, false};
+    } else {
+      entries.erase(key);
+    }
+  }
+  parsed.notify_all();
+}
+
+void ImportCache::forget(const ContentKey &key, const Image *image) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = entries.find(key);
+  if (it != entries.end() && !it->second.parsing &&
+      it->second.image.lock().get() == image) {
+    entries.erase(it);
+  }
+}
+
+void ImportCache::printSummary(std::ostream &out) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (hits > 0) {
+    out << "[INFO] Import dedup: " << hits << " hits, " << bytesSaved
+        << " bytes and " << secondsSaved * 1000 << " ms of parsing saved\n";
+  }
+}
+
+ImportCache importCache;
+/******************** END IMPORT CACHE CLASS ********************/
+
+/******************** RESULT CACHE CLASS ********************/
+// Exported files kept in a directory across runs, indexed by a recipe: the
+// contents of the imported file and the operations applied to it since. An
+// export with a known recipe copies the earlier result instead of parsing,
+// processing and writing the image again. The least recently used results
+// are deleted once the directory grows past its size limit.
+class ResultCache {
+private:
+  std::filesystem::path directory;
+  uintmax_t sizeLimit;
+  std::mutex mutex;
+
+  std::filesystem::path getPath(const std::string &recipe) const;
+  void prune();
+
+public:
+  ResultCache() : sizeLimit(0) {}
+  bool open(const std::string &path, uintmax_t limit);
+  bool isEnabled() const { return !directory.empty(); }
+  bool fetch(const std::string &recipe, const std::string &filename);
+  bool fetch(const std::string &recipe, int descriptor, bool &started);
+  void store(const std::string &recipe, const std::string &filename);
+};
+
+bool ResultCache::open(const std::string &path, uintmax_t limit) {
+  std::error_code error;
+  std::filesystem::create_directories(path, error);
+  if (!std::filesystem::is_directory(path, error)) {
+    return false;
+  }
+  directory = path;
+  sizeLimit = limit;
+  return true;
+}
+
+std::filesystem::path ResultCache::getPath(const std::string &recipe) const {
+  std::ostringstream name;
+  name << std::hex << hashBytes(recipe.data(), recipe.size()) << ".pnm";
+  return directory / name.str();
+}
+
+// Copies the result of a recipe to `filename`. Returns false if the cache
+// does not hold it.
+bool ResultCache::fetch(const std::string &recipe,
+                        const std::string &filename) {
+  std::error_code error;
+  std::filesystem::path cached = getPath(recipe);
+  if (!std::filesystem::copy_file(cached, filename, error)) {
+    return false;
+  }
+
+  // The modification time orders the results for pruning
+  std::filesystem::last_write_time(
+      cached, std::filesystem::file_time_type::clock::now(), error);
+  return true;
+}
+
+// Writes the result of a recipe to a pipe or the standard output, copying
+// it inside the kernel. Returns false if the cache does not hold it or the
+// writing failed; `started` tells whether part of the image went out, as the
+// reader would then get it twice if it were written again.
+bool ResultCache::fetch(const std::string &recipe, int descriptor,
+                        bool &started) {
+  started = false;
+  std::filesystem::path cached = getPath(recipe);
+  int fd = ::open(cached.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat status;
+  bool sent = fstat(fd, &status) == 0;
+  off_t offset = 0;
+  while (sent && offset < status.st_size) {
+    ssize_t written =
+        sendfile(descriptor, fd, &offset, status.st_size - offset);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    sent = written > 0;
+  }
+  close(fd);
+  started = offset > 0;
+
+  std::error_code error;
+  std::filesystem::last_write_time(
+      cached, std::filesystem::file_time_type::clock::now(), error);
+  return sent;
+}
+
+// Adds the file exported for a recipe to the cache
+void ResultCache::store(const std::string &recipe,
+                        const std::string &filename) {
+  std::error_code error;
+  std::filesystem::path cached = getPath(recipe);
+  std::ostringstream temporary;
+  temporary << cached.string() << "." << getpid() << "."
+            << std::this_thread::get_id() << ".tmp";
+
+  // Other processes may share the directory, so results appear atomically
+  if (!std::filesystem::copy_file(filename, temporary.str(), error)) {
+    return;
+  }
+  std::filesystem::rename(temporary.str(), cached, error);
+  if (error) {
+    std::filesystem::remove(temporary.str(), error);
+    return;
+  }
+
+  prune();
+}
+
+void ResultCache::prune() {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::error_code error;
+  std::vector<std::pair<std::filesystem::file_time_type,
+                        std::filesystem::path>>
+      results;
+  uintmax_t totalSize = 0;
+
+  for (const auto &entry :
+       std::filesystem::directory_iterator(directory, error)) {
+    if (entry.path().extension() != ".pnm") {
+      continue;
+    }
+    totalSize += entry.file_size(error);
+    results.emplace_back(entry.last_write_time(error), entry.path());
+  }
+
+  std::sort(results.begin(), results.end());
+  for (const auto &result : results) {
+    if (totalSize <= sizeLimit) {
+      break;
+    }
+    uintmax_t size = std::filesystem::file_size(result.second, error);
+    if (std::filesystem::remove(result.second, error)) {
+      totalSize -= size;
+    }
+  }
+}
+
+ResultCache resultCache;
+/******************** END RESULT CACHE CLASS ********************/
+
+/******************** PYRAMID CACHE CLASS ********************/
+// Successive 2x box-filtered copies of images, built on demand for
+// --pyramid. They are kept with the image they were built from for as long
+// as it lives unchanged, so scaling the same image again, or another token
+// sharing it, starts from the levels already built.
+class PyramidCache {
+private:
+  struct Entry {
+    std::weak_ptr<Image> image;
+    unsigned long version;
+    // levels[0] is the first half-size level
+    std::vector<std::shared_ptr<Image>> levels;
+    std::mutex mutex;
+  };
+
+  std::map<const Image *, std::shared_ptr<Entry>> entries;
+  std::mutex mutex;
+
+public:
+  std::shared_ptr<Image> getLevel(const std::shared_ptr<Image> &image,
+                                  int level);
+  void forget(const Image *image);
+};
+
+// Returns the image halved `level` times, or nullptr if it would be smaller
+// than a single pixel. Level 0 is the image itself. The image must not
+// change while this runs, which holds for images shared by tokens and for
+// the image of a locked token.
+std::shared_ptr<Image>
+PyramidCache::getLevel(const std::shared_ptr<Image> &image, int level) {
+  if (level == 0 || image == nullptr) {
+    return image;
+  }
+
+  std::shared_ptr<Entry> entry;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    // The levels of images that are gone are of no use anymore
+    for (auto it = entries.begin(); it != entries.end();) {
+      it = it->second->image.expired() ? entries.erase(it) : std::next(it);
+    }
+    std::shared_ptr<Entry> &found = entries[image.get()];
+    if (found == nullptr || found->image.lock() != image) {
+      found = std::make_shared<Entry>();
+      found->image = image;
+      found->version = image->getVersion();
+    }
+    entry = found;
+  }
+
+  // Other images build their levels meanwhile
+  std::lock_guard<std::mutex> lock(entry->mutex);
+  if (entry->version != image->getVersion()) {
+    entry->levels.clear();
+    entry->version = image->getVersion();
+  }
+  while (static_cast<int>(entry->levels.size()) < level) {
+    const Image *previous =
+        entry->levels.empty() ? image.get() : entry->levels.back().get();
+    if (previous->getWidth() < 2 || previous->getHeight() < 2) {
+      return nullptr;
+    }
+    entry->levels.push_back(std::shared_ptr<Image>(previous->halve()));
+  }
+  return entry->levels[level - 1];
+}
+
+// Drops the levels of an image that is about to change in place
+void PyramidCache::forget(const Image *image) {
+  std::lock_guard<std::mutex> lock(mutex);
+  entries.erase(image);
+}
+
+PyramidCache pyramidCache;
+/******************** END PYRAMID CACHE CLASS ********************/
+
+/******************** OPERATION CLASS ********************/
+// A command that modifies the image of a token
+class Operation {
+private:
+  char code;
+  double factor;
+  int times;
+  // The matrix a, b, c, d of a warp followed by 1 for bilinear sampling or
+  // 0 for nearest, the type, radius and border of a filter, or the left,
+  // top, width and height of a crop
+  std::vector<double> parameters;
+
+public:
+  Operation(char code, double factor = 1, int times = 0)
+      : code(code), factor(factor), times(times) {}
+  Operation(char code, const std::vector<double> &parameters)
+      : code(code), factor(1), times(0), parameters(parameters) {}
+  char getCode() const { return code; }
+  double getFactor() const { return factor; }
+  int getTimes() const { return times; }
+  const std::vector<double> &getParameters() const { return parameters; }
+  std::string toString() const;
+};
+
+std::string Operation::toString() const {
+  std::ostringstream text;
+  text.precision(17);
+  text << code;
+  if (code == 's') {
+    text << " " << factor;
+  } else if (code == 'r') {
+    text << " " << times;
+  }
+  for (double parameter : parameters) {
+    text << " " << parameter;
+  }
+  return text.str();
+}
+/******************** END OPERATION CLASS ********************/
+
+class Token;
+void runOperation(Token &token, const Operation &operation);
+
+/******************** TOKEN CLASS ********************/
+class Token {
+private:
+  std::string name;
+  // Shared with other tokens that imported the same file contents
+  std::shared_ptr<Image> ptr;
+  ContentKey source;
+  bool sourceKnown;
+  bool grayscale;
+  // The operations applied since the import, without the ones that cancel
+  // each other out
+  std::vector<std::string> recipe;
+  // A deferred import parses the image only once it is needed and then runs
+  // the operations applied in the meantime
+  std::function<std::shared_ptr<Image>()> loader;
+  std::vector<Operation> pendingOperations;
+  std::shared_ptr<std::recursive_mutex> loadMutex;
+  // Held shared while the image is read and exclusively while it changes
+  std::shared_ptr<std::shared_mutex> lock;
+  // A downsampled copy of the image that operations run on right away,
+  // while the image itself only records them until it is needed. Its width
+  // is proxyScale times the width of the image.
+  std::shared_ptr<Token> proxy;
+  double proxyScale;
+
+  void record(const Operation &operation);
+  void materialize();
+
+public:
+  Token(const std::string &tokenName = "", Image *imagePtr = nullptr);
+  std::string getName() const;
+  Image *getPtr();
+  std::shared_ptr<Image> getSharedPtr();
+  Image *getMutablePtr();
+  void setName(const std::string &tokenName);
+  void setPtr(Image *imagePtr);
+  void setSharedPtr(const std::shared_ptr<Image> &imagePtr);
+  void setLoader(const std::function<std::shared_ptr<Image>()> &load,
+                 bool isGrayscale);
+  void setSource(const ContentKey &contentKey, bool isGrayscale);
+  void deriveFrom(const Token &token, const Operation &operation);
+  bool isGrayscale() const;
+  std::string getRecipe() const;
+  void apply(const Operation &operation);
+  void createProxy(int size);
+  Image *getPreviewPtr();
+  std::shared_mutex &getLock() const;
+};
+
+Token::Token(const std::string &tokenName, Image *imagePtr)
+    : ptr(imagePtr), source(0, 0), sourceKnown(false), grayscale(false),
+      loadMutex(std::make_shared<std::recursive_mutex>()),
+      lock(std::make_shared<std::shared_mutex>()), proxyScale(1) {
+  name = tokenName;
+  grayscale = dynamic_cast<GSCImage *>(imagePtr) != nullptr;
+}
+
+std::string Token::getName() const { return name; }
+
+Image *Token::getPtr() {
+  materialize();
+  return ptr.get();
+}
+
+std::shared_ptr<Image> Token::getSharedPtr() {
+  materialize();
+  return ptr;
+}
+
+// Returns the image for modification, copying it first if other tokens or
+// views share it, or if it is a view itself.
+Image *Token::getMutablePtr() {
+  materialize();
+  if (ptr == nullptr) {
+    return nullptr;
+  }
+
+  importCache.forget(source, ptr.get());
+  if (ptr.use_count() > 1 || ptr->isView()) {
+    ptr.reset(ptr->clone());
+  } else {
+    pyramidCache.forget(ptr.get());
+  }
+  return ptr.get();
+}
+
+void Token::setName(const std::string &tokenName) { name = tokenName; }
+
+void Token::setPtr(Image *imagePtr) {
+  if (imagePtr != ptr.get()) {
+    ptr.reset(imagePtr);
+  }
+}
+
+void Token::setSharedPtr(const std::shared_ptr<Image> &imagePtr) {
+  ptr = imagePtr;
+}
+
+void Token::setLoader(const std::function<std::shared_ptr<Image>()> &load,
+                      bool isGrayscale) {
+  loader = load;
+  grayscale = isGrayscale;
+  pendingOperations.clear();
+}
+
+// Sets the contents of the file the image was imported from
+void Token::setSource(const ContentKey &contentKey, bool isGrayscale) {
+  source = contentKey;
+  sourceKnown = true;
+  grayscale = isGrayscale;
+  recipe.clear();
+}
+
+// Takes the origin of the image of another token, which `operation` turned
+// into the image of this one
+void Token::deriveFrom(const Token &token, const Operation &operation) {
+  source = token.source;
+  sourceKnown = token.sourceKnown;
+  grayscale = token.grayscale;
+  recipe = token.recipe;
+  record(operation);
+}
+
+bool Token::isGrayscale() const { return grayscale; }
+
+// Describes how the image was made, or returns an empty string if its
+// origin is unknown.
+std::string Token::getRecipe() const {
+  if (!sourceKnown) {
+    return "";
+  }
+
+  std::ostringstream text;
+  text << std::hex << source.first << std::dec << " " << source.second;
+  for (const auto &step : recipe) {
+    text << ";" << step;
+  }
+  return text.str();
+}
+
+void Token::record(const Operation &operation) {
+  if (operation.getCode() == 'g') {
+    if (grayscale) {
+      return;
+    }
+    grayscale = true;
+  }
+
+  if (operation.getCode() == 'r') {
+    // Consecutive rotations add up to a single one
+    int times = (operation.getTimes() % 4 + 4) % 4;
+    if (!recipe.empty() && recipe.back()[0] == 'r') {
+      times = (times + std::stoi(recipe.back().substr(2))) % 4;
+      recipe.pop_back();
+    }
+    if (times != 0) {
+      recipe.push_back(Operation('r', 1, times).toString());
+    }
+    return;
+  }
+
+  // Inverting or mirroring twice gives back the original image
+  std::string step = operation.toString();
+  if ((operation.getCode() == 'n' || operation.getCode() == 'm') &&
+      !recipe.empty() && recipe.back() == step) {
+    recipe.pop_back();
+    return;
+  }
+  recipe.push_back(step);
+}
+
+// Applies an operation to the image, or records it for later if the image
+// has not been parsed yet or has a proxy.
+void Token::apply(const Operation &operation) {
+  record(operation);
+
+  std::lock_guard<std::recursive_mutex> guard(*loadMutex);
+  if (proxy) {
+    // Filters reach as far on the proxy as on the image
+    Operation scaled = operation;
+    if (operation.getCode() == 'f') {
+      std::vector<double> parameters = operation.getParameters();
+      parameters[1] = std::max(1.0, std::round(parameters[1] * proxyScale));
+      scaled = Operation('f', parameters);
+    }
+    proxy->apply(scaled);
+  }
+
+  if (loader || proxy) {
+    pendingOperations.push_back(operation);
+  } else {
+    runOperation(*this, operation);
+  }
+}
+
+// Parses the image if that was deferred and runs the operations recorded
+// since
+void Token::materialize() {
+  std::lock_guard<std::recursive_mutex> guard(*loadMutex);
+  if (loader) {
+    std::function<std::shared_ptr<Image>()> load = std::move(loader);
+    loader = nullptr;
+    setSharedPtr(load());
+  }
+  if (pendingOperations.empty()) {
+    return;
+  }
+
+  std::vector<Operation> operations = std::move(pendingOperations);
+  pendingOperations.clear();
+  for (const auto &operation : operations) {
+    if (ptr != nullptr) {
+      runOperation(*this, operation);
+    }
+  }
+}
+
+// Gives the token a proxy halved until neither side is larger than `size`,
+// unless the image already fits
+void Token::createProxy(int size) {
+  Image *image = getPtr();
+  if (proxy != nullptr || image == nullptr) {
+    return;
+  }
+
+  Image *small = nullptr;
+  const Image *current = image;
+  while ((current->getWidth() > size || current->getHeight() > size) &&
+         current->getWidth() >= 2 && current->getHeight() >= 2) {
+    Image *half = current->halve();
+    delete small;
+    small = half;
+    current = half;
+  }
+  if (small != nullptr) {
+    proxyScale = static_cast<double>(small->getWidth()) / image->getWidth();
+    proxy = std::make_shared<Token>(name, small);
+  }
+}
+
+// Returns the proxy, or the image if the token has none
+Image *Token::getPreviewPtr() {
+  if (proxy != nullptr) {
+    return proxy->getPtr();
+  }
+  return getPtr();
+}
+
+std::shared_mutex &Token::getLock() const { return *lock; }
+/******************** END TOKEN CLASS ********************/
+
+/******************** TOKEN REGISTRY CLASS ********************/
+// The tokens of a session. Commands that add or remove tokens hold the
+// registry lock exclusively, every other command holds it shared and locks
+// the token it works on, so commands on different tokens run in parallel.
+class TokenRegistry {
+private:
+  std::vector<Token> tokenList;
+  std::shared_mutex mutex;
+
+public:
+  std::vector<Token> &getTokens() { return tokenList; }
+  std::shared_mutex &getMutex() { return mutex; }
+  ~TokenRegistry();
+};
+/******************** END TOKEN REGISTRY CLASS ********************/
+
+/******************** MAIN ********************/
+// Command line options shared by every session
+struct Options {
+  bool usePyramid = false;
+  int threads = std::max(1u, std::thread::hardware_concurrency());
+  std::string cacheDirectory;
+  uintmax_t cacheSize = 1024;
+  // In MB, 0 for no limit other than the one of the cgroup
+  uintmax_t memoryBudget = 0;
+  bool instrument = false;
+  bool profile = false;
+  // Longest side of the proxies of tokens, 0 for none
+  int proxySize = 0;
+  // Block sizes and thread counts of the kernels, measured by --calibrate
+  std::string tuningFile;
+  bool calibrate = false;
+} options;
+
+std::vector<Token>::iterator findToken(std::vector<Token> &tokenList,
+                                       const std::string &token) {
+  return std::find_if(tokenList.begin(), tokenList.end(),
+                      [&](const Token &t) { return t.getName() == token; });
+}
+
+// Reads the number at the start of `text` like std::stod(), but returns
+// false instead of throwing when there is none
+bool parseNumber(const std::string &text, double &value) {
+  char *end;
+  errno = 0;
+  value = std::strtod(text.c_str(), &end);
+  return end != text.c_str() && errno != ERANGE && std::isfinite(value);
+}
+
+bool fileExists(const std::string &filename) {
+  std::ifstream file(filename);
+  return file.good();
+}
+
+// Tells whether a source or destination is "-", the standard input or
+// output, or a named pipe. Opening a pipe only to check it would take the
+// place of the other end, so streams are read and written as they come.
+bool isStream(const std::string &filename) {
+  struct stat status;
+  return filename == "-" ||
+         (stat(filename.c_str(), &status) == 0 && S_ISFIFO(status.st_mode));
+}
+
+// Writes to a file descriptor through a buffer, for the standard output,
+// which std::ofstream cannot open without truncating what it points to
+class DescriptorBuffer : public std::streambuf {
+private:
+  int fd;
+  std::vector<char> buffer;
+  bool failed;
+
+protected:
+  int overflow(int c) override;
+  int sync() override;
+
+public:
+  explicit DescriptorBuffer(int descriptor)
+      : fd(descriptor), buffer(1 << 16), failed(false) {
+    setp(buffer.data(), buffer.data() + buffer.size());
+  }
+  ~DescriptorBuffer() override { sync(); }
+};
+
+int DescriptorBuffer::overflow(int c) {
+  if (sync() != 0) {
+    return traits_type::eof();
+  }
+  if (c != traits_type::eof()) {
+    *pptr() = traits_type::to_char_type(c);
+    pbump(1);
+  }
+  return traits_type::not_eof(c);
+}
+
+int DescriptorBuffer::sync() {
+  const char *data = pbase();
+  while (!failed && data < pptr()) {
+    ssize_t written = write(fd, data, pptr() - data);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    failed = written <= 0;
+    data += written > 0 ? written : 0;
+  }
+  setp(buffer.data(), buffer.data() + buffer.size());
+  return failed ? -1 : 0;
+}
+
+// Reads an image file into memory and checks its format. Returns false,
+// after printing the reason, if it cannot be imported.
+bool readImageFile(const std::string &filename, std::string &contents,
+                   ContentKey &key, bool &grayscale, std::ostream &out) {
+  std::ifstream f(filename, std::ios::binary);
+  if (!f.is_open()) {
+    out << "[ERROR] Unable to open " << filename << std::endl;
+    return false;
+  }
+  contents.assign(std::istreambuf_iterator<char>(f),
+                  std::istreambuf_iterator<char>());
+
+  std::string type;
+  std::istringstream header(contents.substr(0, 64));
+  header >> type;
+  if (type != "P3" && type != "P2") {
+    out << "[ERROR] Invalid file format" << std::endl;
+    return false;
+  }
+
+  key = ContentKey(hashBytes(contents.data(), contents.size()),
+                   contents.size());
+  grayscale = type == "P2";
+  return true;
+}
+
+// Parses the contents of an image file. Contents that were imported before
+// share the image decoded back then.
+std::shared_ptr<Image> decodeImage(const std::string &contents,
+                                   const ContentKey &key) {
+  std::shared_ptr<Image> image = importCache.find(key);
+  if (image) {
+    return image;
+  }
+
+  ProfileScope scope("decode", 0);
+  auto start = std::chrono::steady_clock::now();
+  std::istringstream stream(contents);
+  try {
+    image.reset(readNetpbmImage(stream));
+  } catch (...) {
+    // Release the reservation, or imports waiting for it would never return
+    importCache.add(key, nullptr, 0);
+    throw;
+  }
+  if (image) {
+    scope.setPixels(static_cast<uint64_t>(image->getWidth()) *
+                    image->getHeight());
+  }
+  std::chrono::duration<double> parseTime =
+      std::chrono::steady_clock::now() - start;
+
+  importCache.add(key, image, parseTime.count());
+  return image;
+}
+
+void exportImageToFile(const std::string &filename, Image &image,
+                       std::ostream &out) {
+  // Open the file for writing
+  std::ofstream file(filename);
+  if (!file) {
+    out << "[ERROR] Unable to create file" << std::endl;
+    return;
+  }
+
+  ProfileScope scope("encode", static_cast<uint64_t>(image.getWidth()) *
+                                  image.getHeight());
+  file << image;
+
+  file.close();
+}
+
+// Writes an image to the standard output or a named pipe, opened as `fd`
+void exportImageToStream(int fd, Image &image, std::ostream &out) {
+  ProfileScope scope("encode", static_cast<uint64_t>(image.getWidth()) *
+                                  image.getHeight());
+  DescriptorBuffer buffer(fd);
+  std::ostream stream(&buffer);
+  stream << image << std::flush;
+  if (!stream) {
+    out << "[ERROR] Unable to write the image" << std::endl;
+  }
+}
+
+void deleteToken(Token &token) { token.setPtr(nullptr); }
+
+TokenRegistry::~TokenRegistry() {
+  for (auto &token : tokenList) {
+    deleteToken(token);
+  }
+
+  tokenList.clear(); // Clear the vector after deleting tokens
+}
+
+void invertColor(Image &image) { image = !image; }
+
+void histogramEqualization(Image &image) { image = ~image; }
+
+void invertImageInYAxis(Image &image) { image = *image; }
+
+Image *rgbToGsc(Image &image) {
+  RGBImage *rgbImage = dynamic_cast<RGBImage *>(&image);
+  if (rgbImage) {
+    return new GSCImage(*rgbImage);
+  }
+  return &image;
+}
+
+void scale(Image &image, double factor) { image *= factor; }
+
+// Scales starting from the smallest pyramid level that is still at least as
+// large as the result. The levels stay with the image, so scaling it again
+// only reads a fraction of the original pixels.
+void scaleFromPyramid(Token &token, double factor) {
+  std::shared_ptr<Image> image = token.getSharedPtr();
+  int newWidth = static_cast<int>(image->getWidth() * factor);
+  int newHeight = static_cast<int>(image->getHeight() * factor);
+
+  int level = 0;
+  double levelFactor = factor;
+  std::shared_ptr<Image> chosen = image;
+  while (levelFactor * 2 <= 1) {
+    std::shared_ptr<Image> next = pyramidCache.getLevel(image, level + 1);
+    if (next == nullptr ||
+        static_cast<int>(next->getWidth() * levelFactor * 2) != newWidth ||
+        static_cast<int>(next->getHeight() * levelFactor * 2) != newHeight) {
+      break;
+    }
+    level++;
+    levelFactor *= 2;
+    chosen = next;
+  }
+
+  if (level == 0) {
+    // Let go of the image first, so that the token does not copy it when it
+    // is the only one to hold it
+    image.reset();
+    chosen.reset();
+    scale(*(token.getMutablePtr()), factor);
+    return;
+  }
+
+  Image *resized = chosen->clone();
+  scale(*resized, levelFactor);
+  token.setPtr(resized);
+}
+
+// Bytes that may still be allocated before reaching --memory-budget or the
+// memory limit of the cgroup of the process, whichever comes first
+uintmax_t getAvailableMemory() {
+  uintmax_t available = UINTMAX_MAX;
+  if (options.memoryBudget > 0) {
+    std::ifstream statm("/proc/self/statm");
+    uintmax_t pages = 0;
+    uintmax_t residentPages = 0;
+    statm >> pages >> residentPages;
+    uintmax_t resident = residentPages * sysconf(_SC_PAGESIZE);
+    uintmax_t budget = options.memoryBudget * 1024 * 1024;
+    available = budget > resident ? budget - resident : 0;
+  }
+
+  // Reads "max" when there is no limit, which fails as a number
+  std::ifstream limitFile("/sys/fs/cgroup/memory.max");
+  std::ifstream usageFile("/sys/fs/cgroup/memory.current");
+  uintmax_t limit;
+  uintmax_t usage;
+  if (limitFile >> limit && usageFile >> usage) {
+    available = std::min(available, limit > usage ? limit - usage : 0);
+  }
+  return available;
+}
+
+// Rotating through a temporary image holds up to two more copies of the
+// pixels at once, so rotate in place when they would not fit
+void rotate(Image &image, int times) {
+  if (getAvailableMemory() < 2 * image.getPixelBytes()) {
+    image.rotateInPlace(times);
+  } else {
+    image += times;
+  }
+}
+
+// Times the separable filters against the naive 2-D convolution on the
+// image of a file and checks that both give the same result
+int runFilterBenchmark(const std::string &filename) {
+  std::string contents;
+  ContentKey key;
+  bool grayscale;
+  if (!readImageFile(filename, contents, key, grayscale, std::cout)) {
+    return 1;
+  }
+  std::shared_ptr<Image> image = decodeImage(contents, key);
+  SamplePlane source = toSamplePlane(*image);
+
+  auto milliseconds = [](const std::function<SamplePlane()> &filter,
+                         SamplePlane &result) {
+    auto start = std::chrono::steady_clock::now();
+    result = filter();
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+  };
+
+  std::cout << "[BENCH] " << filename << " (" << source.width << "x"
+            << source.height << "x" << source.channels << ")\n";
+  for (int radius : {1, 2, 4, 8, 16}) {
+    for (bool isBox : {true, false}) {
+      if (!isBox && radius > 4) {
+        continue;
+      }
+      SeparableKernel kernel = isBox ? boxKernel(radius) : gaussianKernel(radius);
+      SamplePlane naive;
+      SamplePlane separable;
+      double naiveTime = milliseconds(
+          [&]() { return convolveNaive(source, kernel, BorderMode::Mirror); },
+          naive);
+      double separableTime = milliseconds(
+          [&]() {
+            return convolveSeparable(source, kernel, BorderMode::Mirror);
+          },
+          separable);
+      std::cout << "[BENCH] " << (isBox ? "box" : "blur") << " radius "
+                << radius << ": naive " << naiveTime << " ms, separable "
+                << separableTime << " ms, "
+                << naiveTime / std::max(separableTime, 1e-3) << "x, "
+                << (naive.samples == separable.samples ? "identical"
+                                                       : "DIFFERENT")
+                << "\n";
+    }
+  }
+  return 0;
+}
+// Runs an operation on the image of a token
+void runOperation(Token &token, const Operation &operation) {
+  if (memoryStats.enabled) {
+    memoryStats.bytesRead += token.getPtr()->getPixelBytes();
+  }
+
+  static const std::map<char, std::string> kernelNames = {
+      {'n', "invert"}, {'z', "equalize"}, {'m', "mirror"},
+      {'g', "grayscale"}, {'s', "scale"}, {'r', "rotate"},
+      {'w', "warp"},   {'f', "filter"}};
+  Image *image = token.getPtr();
+  ProfileScope scope(kernelNames.at(operation.getCode()),
+                     static_cast<uint64_t>(image->getWidth()) *
+                         image->getHeight());
+
+  switch (operation.getCode()) {
+  case 'n':
+    invertColor(*(token.getMutablePtr()));
+    break;
+  case 'z':
+    histogramEqualization(*(token.getMutablePtr()));
+    break;
+  case 'm':
+    invertImageInYAxis(*(token.getMutablePtr()));
+    break;
+  case 'g':
+    token.setPtr(rgbToGsc(*(token.getPtr())));
+    break;
+  case 's':
+    if (options.usePyramid) {
+      scaleFromPyramid(token, operation.getFactor());
+    } else {
+      scale(*(token.getMutablePtr()), operation.getFactor());
+    }
+    break;
+  case 'r':
+    rotate(*(token.getMutablePtr()), operation.getTimes());
+    break;
+  case 'w': {
+    const std::vector<double> &parameters = operation.getParameters();
+    token.setPtr(
+        warp(*(token.getPtr()), parameters.data(), parameters[4] != 0));
+    break;
+  }
+  case 'f': {
+    const std::vector<double> &parameters = operation.getParameters();
+    filterImage(*(token.getMutablePtr()),
+                static_cast<FilterType>(parameters[0]),
+                static_cast<int>(parameters[1]),
+                static_cast<BorderMode>(parameters[2]));
+    break;
+  }
+  }
+
+  if (memoryStats.enabled) {
+    memoryStats.bytesWritten += token.getPtr()->getPixelBytes();
+  }
+}
+
+/******************** SNAPSHOT ********************/
+// A snapshot file starts with a header and ends with an index of its
+// tokens. The raw pixel rows of every token start on a page boundary in
+// between, so they can be mapped into memory and read in place.
+const char snapshotMagic[8] = {'I', 'P', 'S', 'N', 'A', 'P', 0, 1};
+const uint32_t snapshotByteOrder = 0x01020304;
+const uint64_t snapshotAlignment = 4096;
+
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t byteOrder;
+  uint32_t tokenCount;
+  uint64_t indexOffset;
+};
+
+// Followed by the name of the token
+struct SnapshotEntry {
+  uint32_t width;
+  uint32_t height;
+  uint32_t maxLuminocity;
+  uint32_t channels;
+  uint64_t offset;
+  uint32_t nameLength;
+  uint32_t reserved;
+};
+
+// A file mapped read-only into memory
+class FileMapping {
+private:
+  void *data;
+  size_t size;
+
+public:
+  FileMapping() : data(MAP_FAILED), size(0) {}
+  FileMapping(const FileMapping &) = delete;
+  FileMapping &operator=(const FileMapping &) = delete;
+  bool open(const std::string &filename);
+  const unsigned char *getData() const {
+    return static_cast<const unsigned char *>(data);
+  }
+  size_t getSize() const { return size; }
+  ~FileMapping();
+};
+
+bool FileMapping::open(const std::string &filename) {
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat status;
+  if (fstat(fd, &status) == 0 && status.st_size > 0) {
+    size = status.st_size;
+    data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  return data != MAP_FAILED;
+}
+
+FileMapping::~FileMapping() {
+  if (data != MAP_FAILED) {
+    munmap(data, size);
+  }
+}
+
+// Writes the images of all tokens to a snapshot file. The file is written
+// under a temporary name first, as it may be the one the tokens were loaded
+// from.
+bool saveSnapshot(TokenRegistry &registry, const std::string &filename) {
+  std::string temporary = filename + ".tmp";
+  std::ofstream file(temporary, std::ios::binary);
+  if (!file) {
+    return false;
+  }
+
+  SnapshotHeader header = SnapshotHeader();
+  std::memcpy(header.magic, snapshotMagic, sizeof(header.magic));
+  header.byteOrder = snapshotByteOrder;
+  header.tokenCount = registry.getTokens().size();
+  file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+  std::vector<SnapshotEntry> entries;
+  std::vector<unsigned char> rowBytes;
+  for (auto &token : registry.getTokens()) {
+    Image &image = *(token.getPtr());
+    uint64_t offset = file.tellp();
+    offset = (offset + snapshotAlignment - 1) / snapshotAlignment *
+             snapshotAlignment;
+    file.seekp(offset);
+
+    SnapshotEntry entry = SnapshotEntry();
+    entry.width = image.getWidth();
+    entry.height = image.getHeight();
+    entry.maxLuminocity = image.getMaxLuminocity();
+    entry.channels = image.getChannels();
+    entry.offset = offset;
+    entry.nameLength = token.getName().size();
+    entries.push_back(entry);
+
+    rowBytes.resize(static_cast<size_t>(image.getWidth()) *
+                    image.getChannels());
+    for (int row = 0; row < image.getHeight(); row++) {
+      image.getRowBytes(row, rowBytes.data());
+      file.write(reinterpret_cast<const char *>(rowBytes.data()),
+                 rowBytes.size());
+    }
+  }
+
+  header.indexOffset = file.tellp();
+  for (size_t index = 0; index < entries.size(); index++) {
+    const std::string &name = registry.getTokens()[index].getName();
+    file.write(reinterpret_cast<const char *>(&entries[index]),
+               sizeof(SnapshotEntry));
+    file.write(name.data(), name.size());
+  }
+  file.seekp(0);
+  file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  file.close();
+
+  std::error_code error;
+  std::filesystem::rename(temporary, filename, error);
+  if (!file || error) {
+    std::filesystem::remove(temporary, error);
+    return false;
+  }
+  return true;
+}
+
+// Reads the index of a snapshot file into tokens. Their images are copied
+// out of the mapped file only once they are needed.
+bool loadSnapshot(const std::string &filename, std::vector<Token> &tokens) {
+  auto mapping = std::make_shared<FileMapping>();
+  if (!mapping->open(filename) || mapping->getSize() < sizeof(SnapshotHeader)) {
+    return false;
+  }
+
+  SnapshotHeader header;
+  std::memcpy(&header, mapping->getData(), sizeof(header));
+  if (std::memcmp(header.magic, snapshotMagic, sizeof(header.magic)) != 0 ||
+      header.byteOrder != snapshotByteOrder) {
+    return false;
+  }
+
+  uint64_t position = header.indexOffset;
+  for (uint32_t index = 0; index < header.tokenCount; index++) {
+    SnapshotEntry entry;
+    if (position + sizeof(entry) > mapping->getSize()) {
+      return false;
+    }
+    std::memcpy(&entry, mapping->getData() + position, sizeof(entry));
+    position += sizeof(entry);
+
+    uint64_t pixelBytes =
+        static_cast<uint64_t>(entry.width) * entry.height * entry.channels;
+    if (position + entry.nameLength > mapping->getSize() ||
+        entry.offset + pixelBytes > mapping->getSize() ||
+        (entry.channels != 1 && entry.channels != 3)) {
+      return false;
+    }
+    std::string name(reinterpret_cast<const char *>(mapping->getData()) +
+                         position,
+                     entry.nameLength);
+    position += entry.nameLength;
+
+    Token token;
+    token.setName(name);
+    token.setLoader(
+        [mapping, entry]() -> std::shared_ptr<Image> {
+          const unsigned char *pixels = mapping->getData() + entry.offset;
+          if (entry.channels == 1) {
+            return std::make_shared<GSCImage>(entry.width, entry.height,
+                                              entry.maxLuminocity, pixels);
+          }
+          return std::make_shared<RGBImage>(entry.width, entry.height,
+                                            entry.maxLuminocity, pixels);
+        },
+        entry.channels == 1);
+    tokens.push_back(token);
+  }
+  return true;
+}
+/******************** END SNAPSHOT ********************/
+
+/******************** SHARED STORE ********************/
+// Images published to POSIX shared memory, so that the other processes on
+// the host attach them instead of importing their own copy. A segment is a
+// header followed by the raw pixel rows on a page boundary. The header lists
+// the processes attached to the segment and the last one to detach removes
+// it. Processes that exited without detaching are dropped from the list
+// whenever it changes, and segments that only they held are removed when a
+// process first publishes or attaches an image.
+const char sharedMagic[8] = {'I', 'P', 'S', 'H', 'M', 0, 0, 1};
+const int sharedHolderSlots = 256;
+
+struct SharedImageHeader {
+  char magic[8];
+  uint32_t width;
+  uint32_t height;
+  uint32_t maxLuminocity;
+  uint32_t channels;
+  uint64_t pixelOffset;
+  // Set once the pixels are written
+  uint32_t ready;
+  // Set once the segment is removed, for processes that opened it just before
+  uint32_t removed;
+  // Guards the holders and the removed flag, and survives holders that die
+  // while holding it
+  pthread_mutex_t mutex;
+  // The processes attached to the segment, 0 for a free slot
+  pid_t holders[sharedHolderSlots];
+};
+
+// The attachment of this process to a segment. Its images keep it alive.
+class SharedSegment {
+private:
+  std::string path;
+  SharedImageHeader *header;
+  void *pixels;
+  size_t pixelBytes;
+  int slot;
+
+  bool mapHeader(int fd);
+  void lock();
+  int countHolders();
+
+public:
+  explicit SharedSegment(const std::string &name)
+      : path("/ImageProcessing." + name), header(nullptr), pixels(MAP_FAILED),
+        pixelBytes(0), slot(-1) {}
+  SharedSegment(const SharedSegment &) = delete;
+  SharedSegment &operator=(const SharedSegment &) = delete;
+  bool create(const Image &image);
+  bool open();
+  std::shared_ptr<Image>
+  createImage(const std::shared_ptr<SharedSegment> &self) const;
+  static bool removeIfAbandoned(const std::string &name);
+  ~SharedSegment();
+};
+
+bool SharedSegment::mapHeader(int fd) {
+  void *data = mmap(nullptr, sizeof(SharedImageHeader), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  header = static_cast<SharedImageHeader *>(data);
+  return true;
+}
+
+void SharedSegment::lock() {
+  if (pthread_mutex_lock(&header->mutex) == EOWNERDEAD) {
+    pthread_mutex_consistent(&header->mutex);
+  }
+}
+
+// Drops the holders that no longer run and counts the others. Needs the
+// header lock.
+int SharedSegment::countHolders() {
+  int count = 0;
+  for (auto &holder : header->holders) {
+    if (holder != 0 && kill(holder, 0) != 0 && errno == ESRCH) {
+      holder = 0;
+    }
+    count += holder != 0;
+  }
+  return count;
+}
+
+// Creates the segment with a copy of the pixels of `image`. Fails if the
+// name is taken.
+bool SharedSegment::create(const Image &image) {
+  int fd = shm_open(path.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0) {
+    return false;
+  }
+
+  size_t pageSize = sysconf(_SC_PAGESIZE);
+  size_t offset =
+      (sizeof(SharedImageHeader) + pageSize - 1) / pageSize * pageSize;
+  size_t rowBytes = static_cast<size_t>(image.getWidth()) * image.getChannels();
+  pixelBytes = rowBytes * image.getHeight();
+  if (ftruncate(fd, offset + pixelBytes) != 0 || !mapHeader(fd)) {
+    close(fd);
+    shm_unlink(path.c_str());
+    return false;
+  }
+  pixels = mmap(nullptr, pixelBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                offset);
+  close(fd);
+  if (pixels == MAP_FAILED) {
+    shm_unlink(path.c_str());
+    return false;
+  }
+
+  for (int row = 0; row < image.getHeight(); row++) {
+    image.getRowBytes(row, static_cast<unsigned char *>(pixels) + row * rowBytes);
+  }
+  // Nobody writes to the pixels from now on
+  mprotect(pixels, pixelBytes, PROT_READ);
+
+  std::memcpy(header->magic, sharedMagic, sizeof(header->magic));
+  header->width = image.getWidth();
+  header->height = image.getHeight();
+  header->maxLuminocity = image.getMaxLuminocity();
+  header->channels = image.getChannels();
+  header->pixelOffset = offset;
+  pthread_mutexattr_t attributes;
+  pthread_mutexattr_init(&attributes);
+  pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&header->mutex, &attributes);
+  pthread_mutexattr_destroy(&attributes);
+  slot = 0;
+  header->holders[slot] = getpid();
+  __atomic_store_n(&header->ready, 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+// Attaches to a segment another process created. Fails if there is none by
+// that name or it is being removed.
+bool SharedSegment::open() {
+  int fd = shm_open(path.c_str(), O_RDWR, 0);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat status;
+  if (fstat(fd, &status) != 0 ||
+      static_cast<size_t>(status.st_size) < sizeof(SharedImageHeader) ||
+      !mapHeader(fd)) {
+    close(fd);
+    return false;
+  }
+  if (std::memcmp(header->magic, sharedMagic, sizeof(header->magic)) != 0 ||
+      __atomic_load_n(&header->ready, __ATOMIC_ACQUIRE) == 0) {
+    close(fd);
+    return false;
+  }
+
+  pixelBytes = static_cast<size_t>(header->width) * header->height *
+               header->channels;
+  if (header->pixelOffset + pixelBytes > static_cast<size_t>(status.st_size) ||
+      (header->channels != 1 && header->channels != 3)) {
+    close(fd);
+    return false;
+  }
+  pixels = mmap(nullptr, pixelBytes, PROT_READ, MAP_SHARED, fd,
+                header->pixelOffset);
+  close(fd);
+  if (pixels == MAP_FAILED) {
+    return false;
+  }
+
+  lock();
+  countHolders();
+  if (!header->removed) {
+    for (int index = 0; index < sharedHolderSlots && slot < 0; index++) {
+      if (header->holders[index] == 0) {
+        slot = index;
+        header->holders[slot] = getpid();
+      }
+    }
+  }
+  pthread_mutex_unlock(&header->mutex);
+  return slot >= 0;
+}
+
+// Returns an image that shows the pixels of the segment, which has to be
+// `self`. Tokens copy it before changing it.
+std::shared_ptr<Image>
+SharedSegment::createImage(const std::shared_ptr<SharedSegment> &self) const {
+  unsigned char *bytes = static_cast<unsigned char *>(pixels);
+  size_t stride = static_cast<size_t>(header->width) * header->channels;
+  if (header->channels == 1) {
+    return std::shared_ptr<Image>(GSCImage::wrap(header->width, header->height,
+                                                 header->maxLuminocity, bytes,
+                                                 stride, self));
+  }
+  return std::shared_ptr<Image>(RGBImage::wrap(header->width, header->height,
+                                               header->maxLuminocity, bytes,
+                                               stride, self));
+}
+
+// Removes a segment that every process attached to it left without
+// detaching. Returns true if there is no segment by that name anymore.
+bool SharedSegment::removeIfAbandoned(const std::string &name) {
+  SharedSegment segment(name);
+  int fd = shm_open(segment.path.c_str(), O_RDWR, 0);
+  if (fd < 0) {
+    return errno == ENOENT;
+  }
+
+  struct stat status;
+  bool mapped = fstat(fd, &status) == 0 &&
+                static_cast<size_t>(status.st_size) >=
+                    sizeof(SharedImageHeader) &&
+                segment.mapHeader(fd);
+  close(fd);
+  if (!mapped ||
+      __atomic_load_n(&segment.header->ready, __ATOMIC_ACQUIRE) == 0) {
+    return false;
+  }
+
+  segment.lock();
+  bool abandoned = segment.countHolders() == 0;
+  if (abandoned && !segment.header->removed) {
+    segment.header->removed = 1;
+    shm_unlink(segment.path.c_str());
+  }
+  pthread_mutex_unlock(&segment.header->mutex);
+  return abandoned;
+}
+
+// Detaches from the segment, and removes it if this was the last process
+// attached to it
+SharedSegment::~SharedSegment() {
+  if (header != nullptr && slot >= 0) {
+    lock();
+    header->holders[slot] = 0;
+    if (countHolders() == 0 && !header->removed) {
+      header->removed = 1;
+      shm_unlink(path.c_str());
+    }
+    pthread_mutex_unlock(&header->mutex);
+  }
+  if (pixels != MAP_FAILED) {
+    munmap(pixels, pixelBytes);
+  }
+  if (header != nullptr) {
+    munmap(header, sizeof(SharedImageHeader));
+  }
+}
+
+// The segments this process is attached to, so that it attaches to each
+// only once
+std::map<std::string, std::weak_ptr<SharedSegment>> sharedSegments;
+std::mutex sharedSegmentsMutex;
+bool abandonedSegmentsRemoved = false;
+
+// Removes the segments whose processes all exited without detaching, which
+// nobody else would remove. Needs sharedSegmentsMutex; does its work once.
+void removeAbandonedSegments() {
+  if (abandonedSegmentsRemoved) {
+    return;
+  }
+  abandonedSegmentsRemoved = true;
+
+  const std::string prefix = "ImageProcessing.";
+  std::error_code error;
+  for (std::filesystem::directory_iterator it("/dev/shm", error), end;
+       !error && it != end; it.increment(error)) {
+    std::string file = it->path().filename().string();
+    if (file.compare(0, prefix.size(), prefix) == 0) {
+      SharedSegment::removeIfAbandoned(file.substr(prefix.size()));
+    }
+  }
+}
+
+bool isSharedName(const std::string &name) {
+  return !name.empty() && name.size() <= 200 &&
+         name.find_first_not_of("abcdefghijklmnopqrstuvwxyz"
+                                "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-.") ==
+             std::string::npos;
+}
+
+// Copies an image into a new segment and returns the image shown from it,
+// or nullptr if the name is taken by a process that still runs.
+std::shared_ptr<Image> publishImage(const std::string &name,
+                                    const Image &image) {
+  std::lock_guard<std::mutex> guard(sharedSegmentsMutex);
+  removeAbandonedSegments();
+  auto segment = std::make_shared<SharedSegment>(name);
+  if (!segment->create(image)) {
+    if (errno != EEXIST || !SharedSegment::removeIfAbandoned(name) ||
+        !segment->create(image)) {
+      return nullptr;
+    }
+  }
+  sharedSegments[name] = segment;
+  return segment->createImage(segment);
+}
+
+// Returns the image of a published segment, or nullptr if there is none by
+// that name
+std::shared_ptr<Image> attachImage(const std::string &name) {
+  std::lock_guard<std::mutex> guard(sharedSegmentsMutex);
+  removeAbandonedSegments();
+  std::shared_ptr<SharedSegment> segment = sharedSegments[name].lock();
+  if (segment == nullptr) {
+    segment = std::make_shared<SharedSegment>(name);
+    if (!segment->open()) {
+      return nullptr;
+    }
+    sharedSegments[name] = segment;
+  }
+  return segment->createImage(segment);
+}
+/******************** END SHARED STORE ********************/
+
+/******************** TOKEN GROUPS ********************/
+bool executeCommand(TokenRegistry &registry, const std::string &line,
+                    std::ostream &out);
+void importImage(TokenRegistry &registry, const std::string &photoFile,
+                 const std::string &name, std::ostream &out);
+
+bool hasGlobPattern(const std::string &path) {
+  return path.find_first_of("*?[") != std::string::npos;
+}
+
+// Returns the tokens of a group, $name[0], $name[1] and so on, in order.
+std::vector<std::string> findGroup(TokenRegistry &registry,
+                                   const std::string &name) {
+  std::vector<std::pair<long, std::string>> members;
+  std::shared_lock<std::shared_mutex> registryLock(registry.getMutex());
+  for (const auto &token : registry.getTokens()) {
+    const std::string &member = token.getName();
+    if (member.size() < name.size() + 3 || member.back() != ']' ||
+        member.compare(0, name.size() + 1, name + "[") != 0) {
+      continue;
+    }
+    std::string index = member.substr(name.size() + 1,
+                                      member.size() - name.size() - 2);
+    if (index.find_first_not_of("0123456789") == std::string::npos) {
+      members.emplace_back(std::stol(index), member);
+    }
+  }
+
+  std::sort(members.begin(), members.end());
+  std::vector<std::string> names;
+  for (const auto &member : members) {
+    names.push_back(member.second);
+  }
+  return names;
+}
+
+// Runs a command and reports an exception it throws instead of letting it
+// end the process, which serves other clients and commands as well
+bool runGuarded(const std::function<bool()> &command, std::ostream &out) {
+  try {
+    return command();
+  } catch (const std::exception &error) {
+    out << "[ERROR] " << error.what() << "\n";
+    return true;
+  }
+}
+
+// Runs commands in parallel and writes their messages in order
+void runAll(const std::vector<std::function<bool(std::ostream &)>> &commands,
+            std::ostream &out) {
+  std::vector<std::string> results(commands.size());
+  getThreadPool().parallelFor(commands.size(), [&](int index) {
+    std::ostringstream memberOut;
+    runGuarded([&]() { return commands[index](memberOut); }, memberOut);
+    results[index] = memberOut.str();
+  });
+  for (const auto &result : results) {
+    out << result;
+  }
+}
+
+// Runs command lines in parallel and writes their messages in order
+void executeAll(TokenRegistry &registry, const std::vector<std::string> &lines,
+                std::ostream &out) {
+  std::vector<std::function<bool(std::ostream &)>> commands;
+  for (const auto &line : lines) {
+    commands.push_back([&registry, &line](std::ostream &memberOut) {
+      return executeCommand(registry, line, memberOut);
+    });
+  }
+  runAll(commands, out);
+}
+
+// Runs commands on whole groups of tokens: an import of every file that
+// matches a pattern, or an operation or export on every token of a group.
+// Returns false if the line is not such a command.
+bool executeGroupCommand(TokenRegistry &registry, const std::string &line,
+                         std::ostream &out) {
+  std::istringstream iss(line);
+  std::string command;
+  std::string first;
+  std::string rest;
+  iss >> command >> first;
+  std::getline(iss, rest);
+
+  if (command == "i" && hasGlobPattern(first)) {
+    std::string as;
+    std::string name;
+    std::istringstream(rest) >> as >> name;
+    if (name.empty() || name[0] != '$' || as != "as") {
+      return false;
+    }
+
+    glob_t matches;
+    if (glob(first.c_str(), 0, nullptr, &matches) != 0) {
+      out << "[ERROR] Unable to open " << first << "\n";
+      return true;
+    }
+    // The matches are imported as they are, as parsing them again as
+    // commands would break names with spaces or pattern characters
+    std::vector<std::function<bool(std::ostream &)>> imports;
+    for (size_t index = 0; index < matches.gl_pathc; index++) {
+      std::string path = matches.gl_pathv[index];
+      std::string member = name + "[" + std::to_string(index) + "]";
+      imports.push_back([&registry, path, member](std::ostream &memberOut) {
+        importImage(registry, path, member, memberOut);
+        return true;
+      });
+    }
+    globfree(&matches);
+
+    runAll(imports, out);
+    return true;
+  }
+
+  if (first.empty() || first[0] != '$' ||
+      (command != "e" && command != "d" && command != "n" &&
+       command != "z" && command != "m" && command != "g" &&
+       command != "s" && command != "r" && command != "w" &&
+       command != "f" && command != "hist" && command != "stat")) {
+    return false;
+  }
+
+  {
+    std::shared_lock<std::shared_mutex> registryLock(registry.getMutex());
+    if (findToken(registry.getTokens(), first) != registry.getTokens().end()) {
+      return false;
+    }
+  }
+  std::vector<std::string> members = findGroup(registry, first);
+  if (members.empty()) {
+    return false;
+  }
+
+  std::vector<std::string> lines;
+  if (command == "e") {
+    // Exports the tokens to a directory as name_0, name_1 and so on. The
+    // directory ends in '/', which also tells the scheduler of scripts that
+    // the export writes files not known in advance.
+    std::string as;
+    std::string directory;
+    std::istringstream(rest) >> as >> directory;
+    if (directory.empty() || directory.back() != '/' || as != "as") {
+      return false;
+    }
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+
+    int digits = std::to_string(members.size() - 1).size();
+    for (size_t index = 0; index < members.size(); index++) {
+      std::ostringstream filename;
+      filename << (std::filesystem::path(directory) / first.substr(1)).string()
+               << "_" << std::setw(digits) << std::setfill('0') << index;
+
+      std::shared_lock<std::shared_mutex> registryLock(registry.getMutex());
+      auto it = findToken(registry.getTokens(), members[index]);
+      if (it != registry.getTokens().end()) {
+        filename << (it->isGrayscale() ? ".pgm" : ".ppm");
+      }
+      lines.push_back("e " + members[index] + " as " + filename.str());
+    }
+  } else {
+    for (const auto &member : members) {
+      lines.push_back(command + " " + member + rest);
+    }
+  }
+
+  executeAll(registry, lines, out);
+  return true;
+}
+/******************** END TOKEN GROUPS ********************/
+
+// Imports an image file, or an image from the standard input for "-", as
+// the token `name`
+void importImage(TokenRegistry &registry, const std::string &photoFile,
+                 const std::string &name, std::ostream &out) {
+  if (!isStream(photoFile) && !fileExists(photoFile)) {
+    out << "[ERROR] Unable to open " << photoFile << "\n";
+    return;
+  }
+
+  std::string contents;
+  ContentKey key;
+  bool grayscale;
+  Token token;
+  token.setName(name);
+  if (photoFile == "-") {
+    // The standard input may carry more images and, in the interactive
+    // mode, the commands after them, so only this image is read
+    token = Token(name, readNetpbmImage(std::cin));
+    if (token.getPtr() == nullptr || !std::cin) {
+      std::cin.clear();
+      out << "[ERROR] Invalid file format" << std::endl;
+      return;
+    }
+  } else if (!readImageFile(photoFile, contents, key, grayscale, out)) {
+    return;
+  } else if (resultCache.isEnabled()) {
+    token.setSource(key, grayscale);
+    // Exports may find their result in the cache, so parse only on demand
+    auto shared = std::make_shared<const std::string>(std::move(contents));
+    token.setLoader([shared, key]() { return decodeImage(*shared, key); },
+                    grayscale);
+  } else {
+    token.setSource(key, grayscale);
+    token.setSharedPtr(decodeImage(contents, key));
+  }
+  if (options.proxySize > 0) {
+    token.createProxy(options.proxySize);
+  }
+
+  std::unique_lock<std::shared_mutex> registryLock(registry.getMutex());
+  auto it = findToken(registry.getTokens(), name);
+  if (it != registry.getTokens().end()) {
+    out << "[ERROR] Token " << name << " already exists!\n";
+    return;
+  }
+
+  registry.getTokens().push_back(token); // Add the token to the list
+  out << "[OK] Import " << name << "\n";
+}
+
+// Runs a single command line against the registry and writes its messages to
+// `out`. Returns false once the session has to end.
+bool executeCommand(TokenRegistry &registry, const std::string &line,
+                    std::ostream &out) {
+  if (executeGroupCommand(registry, line, out)) {
+    return true;
+  }
+
+  std::istringstream iss(line);
+  std::string command;
+  iss >> command;
+
+  if (command == "i") {
+    std::string photoFile;
+    std::string as;
+    std::string name;
+    iss >> photoFile >> as >> name;
+
+    if (photoFile.empty() || name.empty() || name[0] != '$' || as != "as") {
+      out << "\n-- Invalid command! --\n";
+      return true;
+    }
+
+    importImage(registry, photoFile, name, out);
+  } else if (command == "e") {
+    std::string photoFile;
+    std::string as;
+    std::string name;
+    iss >> name >> as >> photoFile;
+
+    if (photoFile.empty() || name.empty() || name[0] != '$' || as != "as") {
+      out << "\n-- Invalid command! --\n";
+      return true;
+    }
+
+    // Opening a pipe waits for its reader, so it is done before taking the
+    // locks, which would otherwise hold back every change meanwhile. The
+    // pipe is opened once, as its reader sees the end of the image when it
+    // is closed.
+    bool stream = isStream(photoFile);
+    int fd = -1;
+    if (stream) {
+      fd = photoFile == "-" ? STDOUT_FILENO
+                            : ::open(photoFile.c_str(), O_WRONLY);
+      if (fd < 0) {
+        out << "[ERROR] Unable to create file" << std::endl;
+        return true;
+      }
+    }
+    auto closeStream = [fd]() {
+      if (fd >= 0 && fd != STDOUT_FILENO) {
+        close(fd);
+      }
+    };
+
+    std::shared_lock<std::shared_mutex> registryLock(registry.getMutex());
+    auto it = findToken(registry.getTokens(), name);
+    if (it == registry.getTokens().end()) {
+      out << "[ERROR] Token " << name << " not found!\n";
+      closeStream();
+      return true;
+    }
+
+    if (!stream && fileExists(photoFile)) {
+      out << "[ERROR] File exists\n";
+      return true;
+    }
+
+    Token &token = *it;
+    std::shared_lock<std::shared_mutex> tokenLock(token.getLock());
+    std::string recipe = token.getRecipe();
+    if (!recipe.empty() && options.usePyramid) {
+      recipe += ";pyramid";
+    }
+
+    if (stream) {
+      // What goes through the pipe is not cached. The image is encoded
+      // unless the cache sent it, or failed after sending part of it.
+      std::cout.flush(); // Messages written so far come first
+      bool started = false;
+      bool sent = !recipe.empty() && resultCache.isEnabled() &&
+                  resultCache.fetch(recipe, fd, started);
+      if (!sent && started) {
+        out << "[ERROR] Unable to write the image" << std::endl;
+      } else if (!sent) {
+        exportImageToStream(fd, *(token.getPtr()), out);
+        if (memoryStats.enabled) {
+          memoryStats.bytesRead += token.getPtr()->getPixelBytes();
+        }
+      }
+      closeStream();
+    } else if (recipe.empty() || !resultCache.isEnabled() ||
+        !resultCache.fetch(recipe, photoFile)) {
+      exportImageToFile(photoFile, *(token.getPtr()), out);
+      if (memoryStats.enabled) {
+        memoryStats.bytesRead += token.getPtr()->getPixelBytes();
+      }
+      if (!recipe.empty() && resultCache.isEnabled()) {
+        resultCache.store(recipe, photoFile);
+      }
+    }
+    out << "[OK] Export " << name << "\n";
+  } else if (command == "preview") {
+    std::string photoFile;
+    std::string as;
+    std::string name;
+    iss >> name >> as >> photoFile;
+
+    if (photoFile.empty() || name.empty() || name[0] != '$' || as != "as") {
+      out << "\n-- Invalid command! --\n";
+      return true;
+    }
+
+    std::shared_lock<std::shared_mutex> registryLock(registry.getMutex());
+    auto it = findToken(registry.getTokens(), name);
+    if (it == registry.getTokens().end()) {
+      out << "[ERROR] Token " << name << " not found!\n";
+      return true;
+    }
+
+    if (fileExists(photoFile)) {
+      out << "[ERROR] File exists\n";
+      return true;
+    }
+
+    Token &token = *it;
+    std::shared_lock<std::shared_mutex> tokenLock(token.getLock());
+    exportImageToFile(photoFile, *(token.getPreviewPtr()), out);
+    out << "[OK] Preview " << name << "\n";
+  } else if (command == "d") {
+    std::string name;
+    iss >> name;
+
+    if (name.empty() || name[0] != '$') {
+      out << "\n-- Invalid command! --\n";
+      return true;
+    }
+
+    std::unique_lock<std::shared_mutex> registryLock(registry.getMutex());
+    auto it = findToken(registry.getTokens(), name);
+    if (it == registry.getTokens().end()) {
+      out << "[ERROR] Token " << name << " not found!\n";
+      return true;
+    }
+    Token &token = *it;
+    deleteToken(token);
+    out << "[OK] Delete " << token.getName() << "\n";
+    registry.getTokens().erase(it);
+  } else if (command == "n") {
+    std::string name;
+    iss >> name;
+
+    if (name.empty() || name[0] != '$') {
+      out << "\n-- Invalid command! --\n";
+      return true;
+    }
+
+    std::shared_lock<std::shared_mutex> registryLock(registry.getMutex());
+    auto it = findToken(registry.getTokens(), name);
+    if (it == registry.getTokens().end()) {
+      out << "[ERROR] Token " << name << " not found!\n";
+      return true;
+    }
+    Token &token = *it;
+    std::unique_lock<std::shared_mutex> tokenLock(token.getLock());
+    token.apply(Operation('n'));
+    out << "[OK] Color Inversion " << token.getName() << "\n";
+  } else if (command == "z") {
+    std::string name;
+    iss >> name;
+
+    if (name.empty() || name[0] != '$') {
+      out << "\n-- Invalid command! --\n";
+      return true;
+    }
+
+    std::shared_lock<std::shared_mutex> registryLock(registry.getMutex());
+    auto it = findToken(registry.getTokens(), name);
+    if (it == registry.getTokens().end()) {
+      out << "[ERROR] Token " << name << " not found!\n";
+      return true;
+    }
+    Token &token = *it;
+    std::unique_lock<std::shared_mutex> tokenLock(token.getLock());
+    token.apply(Operation('z'));
+    out << "[OK] Equalize " << token.getName() << "\n";
+  } else if (command == "m") {
+    std::string name;
+    iss >> name;
+
+    if (name.empty() || name[0] != '$') {
+      out << "\n-- Invalid command! --\n";
+      return true;
+    }
+
+    std::shared_lock<std::shared_mutex> registryLock(registry.getMutex());
+    auto it = findToken(registry.getTokens(), name);
+    if (it == registry.getTokens().end()) {
+      out << "[ERROR] Token " << name << " not found!\n";
+      return true;
+    }
+    Token &token = *it;
+    std::unique_lock<std::shared_mutex> tokenLock(token.getLock());
+    token.apply(Operation('m'));
+    out << "[OK] Mirror " << token.getName() << "\n";
+  } else if (command == "g") {
+    std::string name;
+    iss >> name;
+
+    if (name.empty() || name[0] != '$') {
+      out << "\n-- Invalid command! --\n";
+      return true;
+    }
+
+    std::shared_lock<std::shared_mutex> registryLock(registry.getMutex());
+    auto it = findToken(registry.getTokens(), name);
+    if (it == registry.getTokens().end()) {
+      out << "[ERROR] Token " << name << " not found!\n";
+      return true;
+    }
+    Token &token = *it;
+    std::unique_lock<std::shared_mutex> tokenLock(token.getLock());
+    if (token.isGrayscale()) {
+      out << "[NOP] Already grayscale " << token.getName() << "\n";
+    } else {
+      token.apply(Operation('g'));
+      out << "[OK] Grayscale " << token.getName() << "\n";
+    }
+  } else if (command == "s") {
+    std::string factor;
+    std::string by;
+    std::string name;
+    iss >> name >> by >> factor;
+
+    double factorValue;
+    if (factor.empty() || name.empty() || name[0] != '$' || by != "by" ||
+        !parseNumber(factor, factorValue)) {
+      out << "\n-- Invalid command! --\n";
+      return true;
+    }
+
+    std::shared_lock<std::shared_mutex> registryLock(registry.getMutex());
+    auto it = findToken(registry.getTokens(), name);
+    if (it == registry.getTokens().end()) {
+      out << "[ERROR] Token " << name << " not found!\n";
+      return true;
+    }
+
+    if (factorValue > 2 || factorValue < 0) {
+      out << "[ERROR] Wrong factor!" << factor << "\n";
+      return true;
+    }
+
+    Token &token = *it;
+    std::unique_lock<std::shared_mutex> tokenLock(token.getLock());
+    token.apply(Operation('s', factorValue));
+    out << "[OK] Scale " << token.getName() << "\n";
+  } else if (command == "r") {
+    std::string times;
+    std::string clockwise;
+    std::string name;
+    iss >> name >> clockwise >> times;
+
+    double timesValue;
+    if (times.empty() || name.empty() || name[0] != '$' ||
+        clockwise != "clockwise" || !parseNumber(times, timesValue) ||
+        std::abs(timesValue) > 1e9) {
+      out << "\n-- Invalid command! --\n";
+      return true;
+    }
+
+    std::shared_lock<std::shared_mutex> registryLock(registry.getMutex());
+    auto it = findToken(registry.getTokens(), name);
+    if (it == registry.getTokens().end()) {
+      out << "[ERROR] Token " << name << " not found!\n";
+      return true;
+    }
+
+    Token &token = *it;
+    std::unique_lock<std::shared_mutex> tokenLock(token.getLock());
+    token.apply(Operation('r', 1, timesValue));
+    out << "[OK] Rotate " << token.getName() << "\n";
+  } else if (command == "w") {
+    std::string name;
+    std::string by;
+    double degrees;
+    iss >> name >> by >> degrees;
+
+    if (!iss || name.empty() || name[0] != '$' || by != "by") {
+      out << "\n-- Invalid command! --\n";
+      return true;
+    }
+
+    // Optional shear, scale and sampling, in any order
+    double shearX = 0;
+    double shearY = 0;
+    double factor = 1;
+    bool bilinear = true;
+    std::string option;
+    while (iss >> option) {
+      if (option == "shear" && (iss >> shearX >> shearY)) {
+        continue;
+      } else if (option == "scale" && (iss >> factor)) {
+        continue;
+      } else if (option == "nearest" || option == "bilinear") {
+        bilinear = option == "bilinear";
+        continue;
+      }
+      out << "\n-- Invalid command! --\n";
+      return true;
+    }
+
+    std::shared_lock<std::shared_mutex> registryLock(registry.getMutex());
+    auto it = findToken(registry.getTokens(), name);
+    if (it == registry.getTokens().end()) {
+      out << "[ERROR] Token " << name << " not found!\n";
+      return true;
+    }
+
+    if (factor > 2 || factor <= 0) {
+      out << "[ERROR] Wrong factor!" << factor << "\n";
+      return true;
+    }
+    if (std::abs(shearX) > 2 || std::abs(shearY) > 2 ||
+        std::abs(shearX * shearY - 1) < 1e-6) {
+      out << "[ERROR] Wrong shear!" << shearX << " " << shearY << "\n";
+      return true;
+    }
+
+    double matrix[4];
+    buildAffineMatrix(degrees, shearX, shearY, factor, matrix);
+    std::vector<double> parameters(matrix, matrix + 4);
+    parameters.push_back(bilinear ? 1.0 : 0.0);
+
+    Token &token = *it;
+    std::unique_lock<std::shared_mutex> tokenLock(token.getLock());
+    token.apply(Operation('w', parameters));
+    out << "[OK] Warp " << token.getName() << "\n";
+  } else if (command == "f") {
+    std::string name;
+    std::string filter;
+    iss >> name >> filter;
+
+    const std::vector<std::string> filters = {"box", "blur", "sharpen",
+                                              "edge"};
+    const std::vector<std::string> borders = {"clamp", "mirror", "zero"};
+    auto type = std::find(filters.begin(), filters.end(), filter);
+    if (name.empty() || name[0] != '$' || type == filters.end()) {
+      out << "\n-- Invalid command! --\n";
+      return true;
+    }
+
+    // Optional radius and border, in any order
+    int radius = 1;
+    auto border = borders.begin();
+    std::string option;
+    while (iss >> option) {
+      auto mode = std::find(borders.begin(), borders.end(), option);
+      if (mode != borders.end()) {
+        border = mode;
+      } else if (option.find_first_not_of("0123456789") == std::string::npos &&
+                 option.size() < 4) {
+        radius = std::stoi(option);
+      } else {
+        out << "\n-- Invalid command! --\n";
+        return true;
+      }
+    }
+
+    std::shared_lock<std::shared_mutex> registryLock(registry.getMutex());
+    auto it = findToken(registry.getTokens(), name);
+    if (it == registry.getTokens().end()) {
+      out << "[ERROR] Token " << name << " not found!\n";
+      return true;
+    }
+
+    if (radius < 1 || radius > 100) {
+      out << "[ERROR] Wrong radius!" << radius << "\n";
+      return true;
+    }
+
+    Token &token = *it;
+    std::unique_lock<std::shared_mutex> tokenLock(token.getLock());
+    token.apply(Operation(
+        'f', {static_cast<double>(type - filters.begin()),
+              static_cast<double>(filter == "edge" ? 1 : radius),
+              static_cast<double>(border - borders.begin())}));
+    out << "[OK] Filter " << token.getName() << "\n";
+  } else if (command == "crop") {
+    std::string source;
+    std::string as;
+    std::string name;
+    int left;
+    int top;
+    int width;
+    int height;
+    iss >> source >> left >> top >> width >> height >> as >> name;
+
+    if (!iss || source.empty() || source[0] != '$' || name.empty() ||
+        name[0] != '$' || as != "as") {
+      out << "\n-- Invalid command! --\n";
+      return true;
+    }
+
+    std::unique_lock<std::shared_mutex> registryLock(registry.getMutex());
+    auto it = findToken(registry.getTokens(), source);
+    if (it == registry.getTokens().end()) {
+      out << "[ERROR] Token " << source << " not found!\n";
+      return true;
+    }
+    if (findToken(registry.getTokens(), name) != registry.getTokens().end()) {
+      out << "[ERROR] Token " << name << " already exists!\n";
+      return true;
+    }
+
+    std::shared_ptr<Image> image = it->getSharedPtr();
+    if (left < 0 || top < 0 || width < 1 || height < 1 ||
+        left + width > image->getWidth() ||
+        top + height > image->getHeight()) {
+      out << "[ERROR] Wrong region!" << left << " " << top << " " << width
+          << " " << height << "\n";
+      return true;
+    }
+
+    Token token;
+    token.setName(name);
+    token.deriveFrom(*it, Operation('c', {static_cast<double>(left),
+                                          static_cast<double>(top),
+                                          static_cast<double>(width),
+                                          static_cast<double>(height)}));
+    token.setPtr(image->createView(image, left, top, width, height));
+    if (options.proxySize > 0) {
+      token.createProxy(options.proxySize);
+    }
+    registry.getTokens().push_back(token);
+    out << "[OK] Crop " << name << "\n";
+  } else if (command == "hist") {
+    std::string name;
+    iss >> name;
+
+    if (name.empty() || name[0] != '$') {
+      out << "\n-- Invalid command! --\n";
+      return true;
+    }
+
+    std::shared_lock<std::shared_mutex> registryLock(registry.getMutex());
+    auto it = findToken(registry.getTokens(), name);
+    if (it == registry.getTokens().end()) {
+      out << "[ERROR] Token " << name << " not found!\n";
+      return true;
+    }
+
+    // The image fills its histogram under a lock of its own, so tokens
+    // sharing it can ask for it at the same time
+    Token &token = *it;
+    std::shared_lock<std::shared_mutex> tokenLock(token.getLock());
+    const std::vector<int> &histogram = token.getPtr()->getHistogram();
+
+    long long pixelCount = 0;
+    long long sum = 0;
+    int minimum = -1;
+    int maximum = -1;
+    for (int value = 0; value < static_cast<int>(histogram.size()); value++) {
+      if (histogram[value] > 0) {
+        if (minimum < 0) {
+          minimum = value;
+        }
+        maximum = value;
+        pixelCount += histogram[value];
+        sum += static_cast<long long>(histogram[value]) * value;
+      }
+    }
+
+    if (pixelCount == 0) {
+      out << "[OK] Histogram " << name << ": empty\n";
+      return true;
+    }
+    out << "[OK] Histogram " << name << ": min " << minimum << ", max "
+        << maximum << ", mean " << static_cast<double>(sum) / pixelCount
+        << "\n";
+    for (size_t value = 0; value < histogram.size(); value++) {
+      out << (value > 0 ? " " : "") << histogram[value];
+    }
+    out << "\n";
+  } else if (command == "stat") {
+    std::string name;
+    iss >> name;
+
+    if (name.empty() || name[0] != '$') {
+      out << "\n-- Invalid command! --\n";
+      return true;
+    }
+
+    std::shared_lock<std::shared_mutex> registryLock(registry.getMutex());
+    auto it = findToken(registry.getTokens(), name);
+    if (it == registry.getTokens().end()) {
+      out << "[ERROR] Token " << name << " not found!\n";
+      return true;
+    }
+
+    // The image computes its statistics under a lock of its own, so tokens
+    // sharing it can ask for them at the same time
+    Token &token = *it;
+    std::shared_lock<std::shared_mutex> tokenLock(token.getLock());
+    const std::vector<ChannelStatistics> &statistics =
+        token.getPtr()->getStatistics();
+
+    const std::vector<std::string> channelNames =
+        statistics.size() == 1
+            ? std::vector<std::string>{"gray"}
+            : std::vector<std::string>{"red", "green", "blue"};
+    out << "[OK] Statistics " << name << "\n";
+    for (size_t channel = 0; channel < statistics.size(); channel++) {
+      const ChannelStatistics &channelStatistics = statistics[channel];
+      out << channelNames[channel] << ": min " << channelStatistics.minimum
+          << ", max " << channelStatistics.maximum << ", mean "
+          << channelStatistics.mean << ", stddev "
+          << channelStatistics.standardDeviation << "\n";
+      const std::vector<uint64_t> &histogram = channelStatistics.histogram;
+      for (size_t value = 0; value < histogram.size(); value++) {
+        out << (value > 0 ? " " : "") << histogram[value];
+      }
+      out << "\n";
+    }
+  } else if (command == "save") {
+    std::string snapshotFile;
+    iss >> snapshotFile;
+
+    if (snapshotFile.empty()) {
+      out << "\n-- Invalid command! --\n";
+      return true;
+    }
+
+    // Nothing may change while the snapshot is written
+    std::unique_lock<std::shared_mutex> registryLock(registry.getMutex());
+    if (!saveSnapshot(registry, snapshotFile)) {
+      out << "[ERROR] Unable to create file" << std::endl;
+      return true;
+    }
+    out << "[OK] Save " << snapshotFile << "\n";
+  } else if (command == "load") {
+    std::string snapshotFile;
+    iss >> snapshotFile;
+
+    if (snapshotFile.empty()) {
+      out << "\n-- Invalid command! --\n";
+      return true;
+    }
+
+    std::vector<Token> loaded;
+    if (!loadSnapshot(snapshotFile, loaded)) {
+      out << "[ERROR] Invalid snapshot " << snapshotFile << "\n";
+      return true;
+    }
+
+    std::unique_lock<std::shared_mutex> registryLock(registry.getMutex());
+    for (auto &token : loaded) {
+      if (findToken(registry.getTokens(), token.getName()) !=
+          registry.getTokens().end()) {
+        out << "[ERROR] Token " << token.getName() << " already exists!\n";
+        continue;
+      }
+      registry.getTokens().push_back(token);
+    }
+    out << "[OK] Load " << snapshotFile << "\n";
+  } else if (command == "publish") {
+    std::string name;
+    std::string as;
+    std::string sharedName;
+    iss >> name >> as >> sharedName;
+
+    if (name.empty() || name[0] != '$' || as != "as" ||
+        !isSharedName(sharedName)) {
+      out << "\n-- Invalid command! --\n";
+      return true;
+    }
+
+    std::shared_lock<std::shared_mutex> registryLock(registry.getMutex());
+    auto it = findToken(registry.getTokens(), name);
+    if (it == registry.getTokens().end()) {
+      out << "[ERROR] Token " << name << " not found!\n";
+      return true;
+    }
+
+    // The token moves to the shared pixels, so its own copy can go
+    Token &token = *it;
+    std::unique_lock<std::shared_mutex> tokenLock(token.getLock());
+    std::shared_ptr<Image> image = publishImage(sharedName, *token.getPtr());
+    if (image == nullptr) {
+      out << "[ERROR] Unable to publish " << sharedName << "\n";
+      return true;
+    }
+    token.setSharedPtr(image);
+    out << "[OK] Publish " << name << " as " << sharedName << "\n";
+  } else if (command == "attach") {
+    std::string sharedName;
+    std::string as;
+    std::string name;
+    iss >> sharedName >> as >> name;
+
+    if (name.empty() || name[0] != '$' || as != "as" ||
+        !isSharedName(sharedName)) {
+      out << "\n-- Invalid command! --\n";
+      return true;
+    }
+
+    std::unique_lock<std::shared_mutex> registryLock(registry.getMutex());
+    if (findToken(registry.getTokens(), name) != registry.getTokens().end()) {
+      out << "[ERROR] Token " << name << " already exists!\n";
+      return true;
+    }
+
+    std::shared_ptr<Image> image = attachImage(sharedName);
+    if (image == nullptr) {
+      out << "[ERROR] Shared image " << sharedName << " not found!\n";
+      return true;
+    }
+
+    // The origin of the image is unknown, so it never hits the result cache
+    Token token(name);
+    token.setLoader([image]() { return image; }, image->getChannels() == 1);
+    registry.getTokens().push_back(token);
+    out << "[OK] Attach " << sharedName << " as " << name << "\n";
+  } else if (command == "q") {
+    importCache.printSummary(out);
+    return false;
+  }
+
+  return true;
+}
+// Describes the change of the memory statistics since `start`, with the
+// given peak of image memory
+std::string describeMemoryUse(const MemoryStats &start, int64_t peak) {
+  std::ostringstream text;
+  text << memoryStats.allocations - start.allocations << " allocations, "
+       << memoryStats.allocatedBytes - start.allocatedBytes
+       << " bytes allocated, peak images " << peak << " bytes, about "
+       << memoryStats.bytesRead - start.bytesRead << " bytes read and "
+       << memoryStats.bytesWritten - start.bytesWritten << " bytes written";
+  return text.str();
+}
+
+void printMemorySummary(std::ostream &out) {
+  if (memoryStats.enabled) {
+    out << "[MEM] Total: "
+        << describeMemoryUse(MemoryStats(), memoryStats.highestImageBytes)
+        << "\n";
+  }
+}
+
+// Runs a command line like executeCommand() and, with --instrument or
+// --profile, follows its messages with the memory it used and the hardware
+// counters of the command and of each kernel it ran. Commands that run at
+// the same time count each other's work too.
+bool executeAndReport(TokenRegistry &registry, const std::string &line,
+                      std::ostream &out) {
+  if (!memoryStats.enabled && !Profiler::isEnabled()) {
+    return executeCommand(registry, line, out);
+  }
+
+  MemoryStats start;
+  start.allocations = memoryStats.allocations.load();
+  start.allocatedBytes = memoryStats.allocatedBytes.load();
+  start.bytesRead = memoryStats.bytesRead.load();
+  start.bytesWritten = memoryStats.bytesWritten.load();
+  memoryStats.peakImageBytes = memoryStats.imageBytes.load();
+
+  Profiler::Counts counters;
+  if (Profiler::isEnabled()) {
+    Profiler::attachThread();
+    Profiler::takeKernels();
+    counters = Profiler::read();
+  }
+
+  bool keepGoing = executeCommand(registry, line, out);
+  if (!keepGoing) {
+    printMemorySummary(out);
+    return keepGoing;
+  }
+
+  if (memoryStats.enabled) {
+    out << "[MEM] " << describeMemoryUse(start, memoryStats.peakImageBytes)
+        << "\n";
+  }
+  if (Profiler::isEnabled()) {
+    counters = Profiler::difference(Profiler::read(), counters);
+    auto kernels = Profiler::takeKernels();
+    for (const auto &kernel : kernels) {
+      counters.pixels += kernel.second.pixels;
+    }
+    out << "[PERF] " << Profiler::describe(counters) << "\n";
+    for (const auto &kernel : kernels) {
+      out << "[PERF]   " << kernel.first << ": "
+          << Profiler::describe(kernel.second) << "\n";
+    }
+  }
+  return keepGoing;
+}
+/******************** END MAIN ********************/
+
+/******************** DAEMON ********************/
+// Reads the next line sent by the peer, without the trailing newline.
+// Returns false once the peer has closed the connection.
+bool readLine(int fd, std::string &buffer, std::string &line) {
+  while (true) {
+    size_t newline = buffer.find('\n');
+    if (newline != std::string::npos) {
+      line = buffer.substr(0, newline);
+      buffer.erase(0, newline + 1);
+      return true;
+    }
+
+    char chunk[4096];
+    ssize_t received = recv(fd, chunk, sizeof(chunk), 0);
+    if (received < 0 && errno == EINTR) {
+      continue;
+    }
+    if (received <= 0) {
+      if (buffer.empty()) {
+        return false;
+      }
+      line = buffer;
+      buffer.clear();
+      return true;
+    }
+    buffer.append(chunk, received);
+  }
+}
+
+bool writeAll(int fd, const std::string &data) {
+  size_t sent = 0;
+  while (sent < data.size()) {
+    ssize_t written =
+        send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return false;
+    }
+    sent += written;
+  }
+  return true;
+}
+
+// Answers the commands of one client until it sends q or disconnects.
+void serveClient(TokenRegistry &registry, int clientFd) {
+  std::string buffer;
+  std::string line;
+  while (readLine(clientFd, buffer, line)) {
+    std::ostringstream out;
+    bool keepGoing = runGuarded(
+        [&]() { return executeAndReport(registry, line, out); }, out);
+    if (!writeAll(clientFd, out.str()) || !keepGoing) {
+      break;
+    }
+  }
+}
+
+int openUnixSocket(const std::string &socketPath, sockaddr_un &address) {
+  address = sockaddr_un();
+  address.sun_family = AF_UNIX;
+  if (socketPath.size() >= sizeof(address.sun_path)) {
+    std::cout << "[ERROR] Socket path too long " << socketPath << "\n";
+    return -1;
+  }
+  socketPath.copy(address.sun_path, socketPath.size());
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    std::cout << "[ERROR] Unable to create socket\n";
+  }
+  return fd;
+}
+
+// Serves the command protocol on a Unix domain socket. Every connection is
+// handled by its own thread and all of them share one token registry.
+// Threads that are done are joined when the next connection comes, and all
+// of them before the registry goes away.
+int runDaemon(const std::string &socketPath) {
+  sockaddr_un address;
+  int serverFd = openUnixSocket(socketPath, address);
+  if (serverFd < 0) {
+    return 1;
+  }
+
+  unlink(socketPath.c_str());
+  if (bind(serverFd, reinterpret_cast<sockaddr *>(&address),
+           sizeof(address)) < 0 ||
+      listen(serverFd, SOMAXCONN) < 0) {
+    std::cout << "[ERROR] Unable to listen on " << socketPath << "\n";
+    close(serverFd);
+    return 1;
+  }
+  std::cout << "[OK] Listening on " << socketPath << std::endl;
+
+  struct Client {
+    std::thread thread;
+    int fd;
+    std::shared_ptr<std::atomic<bool>> finished;
+  };
+
+  TokenRegistry registry;
+  std::list<Client> clients;
+  while (true) {
+    int clientFd = accept(serverFd, nullptr, nullptr);
+    if (clientFd < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+
+    for (auto it = clients.begin(); it != clients.end();) {
+      if (*it->finished) {
+        it->thread.join();
+        close(it->fd);
+        it = clients.erase(it);
+      } else {
+        ++it;
+      }
+    }
+
+    auto finished = std::make_shared<std::atomic<bool>>(false);
+    std::thread thread([&registry, clientFd, finished]() {
+      serveClient(registry, clientFd);
+      *finished = true;
+    });
+    clients.push_back(Client{std::move(thread), clientFd, finished});
+  }
+
+  // Stop reading from the clients and let their current commands finish
+  for (auto &client : clients) {
+    shutdown(client.fd, SHUT_RDWR);
+  }
+  for (auto &client : clients) {
+    client.thread.join();
+    close(client.fd);
+  }
+  close(serverFd);
+  return 1;
+}
+
+// Sends the commands read from stdin to a daemon and prints its answers.
+int runClient(const std::string &socketPath) {
+  sockaddr_un address;
+  int fd = openUnixSocket(socketPath, address);
+  if (fd < 0) {
+    return 1;
+  }
+
+  if (connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) <
+      0) {
+    std::cout << "[ERROR] Unable to connect to " << socketPath << "\n";
+    close(fd);
+    return 1;
+  }
+
+  std::thread reader([fd]() {
+    char chunk[4096];
+    ssize_t received;
+    while ((received = recv(fd, chunk, sizeof(chunk), 0)) > 0) {
+      std::cout.write(chunk, received);
+      std::cout.flush();
+    }
+  });
+
+  std::string line;
+  while (std::getline(std::cin, line)) {
+    if (!writeAll(fd, line + "\n")) {
+      break;
+    }
+  }
+
+  shutdown(fd, SHUT_WR);
+  reader.join();
+  close(fd);
+  return 0;
+}
+/******************** END DAEMON ********************/
+
+/******************** SCHEDULER ********************/
+// One line of a command script together with its place in the dependency
+// graph.
+struct ScriptCommand {
+  std::string line;
+  std::vector<std::string> reads;
+  std::vector<std::string> writes;
+  std::vector<int> successors;
+  int dependencies = 0;
+  // Works on every token, so it runs alone
+  bool barrier = false;
+};
+
+// Fills in the tokens and files a command reads and writes. Files are
+// prefixed with '@' so they never collide with token names, and tokens of a
+// group count as the group.
+void findCommandResources(ScriptCommand &command) {
+  std::istringstream iss(command.line);
+  std::string name;
+  std::string first;
+  std::string as;
+  std::string second;
+  iss >> name >> first >> as >> second;
+
+  if (name == "i") {
+    second = second.substr(0, second.find('['));
+  } else {
+    first = first.substr(0, first.find('['));
+  }
+
+  // Imports of many files and exports to a directory touch files that are
+  // not known in advance
+  if ((name == "i" && hasGlobPattern(first)) ||
+      (name == "e" && !second.empty() && second.back() == '/')) {
+    command.barrier = true;
+    return;
+  }
+
+  if (name == "crop") {
+    // crop $source left top width height as $name
+    std::string skip;
+    std::istringstream fields(command.line);
+    fields >> skip >> skip >> skip >> skip >> skip >> skip >> skip >> second;
+    command.reads.push_back(first);
+    command.writes.push_back(second.substr(0, second.find('[')));
+  } else if (name == "i") {
+    // Imports from the standard input take the images in turn
+    if (first == "-") {
+      command.writes.push_back("@-");
+    } else {
+      command.reads.push_back("@" + first);
+    }
+    command.writes.push_back(second);
+  } else if (name == "e" || name == "preview") {
+    command.reads.push_back(first);
+    command.writes.push_back("@" + second);
+  } else if (name == "d" || name == "n" || name == "z" || name == "m" ||
+             name == "g" || name == "s" || name == "r" || name == "w" ||
+             name == "f" || name == "hist" || name == "stat") {
+    command.writes.push_back(first);
+  } else if (name == "publish") {
+    // Shared images are prefixed with '%'
+    command.writes.push_back(first);
+    command.writes.push_back("%" + second);
+  } else if (name == "attach") {
+    command.reads.push_back("%" + first);
+    command.writes.push_back(second.substr(0, second.find('[')));
+  } else if (name == "save" || name == "load") {
+    command.barrier = true;
+  }
+}
+
+// Links every command to the earlier commands it has to wait for: the last
+// writer of everything it touches and, for writes, the readers since then.
+// Barriers wait for every earlier command and every later command waits for
+// them.
+void buildDependencyGraph(std::vector<ScriptCommand> &commands) {
+  std::map<std::string, int> lastWriter;
+  std::map<std::string, std::vector<int>> readersSinceWrite;
+  int lastBarrier = -1;
+
+  for (int index = 0; index < static_cast<int>(commands.size()); index++) {
+    ScriptCommand &command = commands[index];
+    std::vector<int> waitFor;
+
+    if (command.barrier) {
+      for (int earlier = lastBarrier + 1; earlier < index; earlier++) {
+        waitFor.push_back(earlier);
+      }
+      lastWriter.clear();
+      readersSinceWrite.clear();
+    }
+    if (lastBarrier >= 0) {
+      waitFor.push_back(lastBarrier);
+    }
+    if (command.barrier) {
+      lastBarrier = index;
+    }
+
+    for (const auto &resource : command.reads) {
+      auto writer = lastWriter.find(resource);
+      if (writer != lastWriter.end()) {
+        waitFor.push_back(writer->second);
+      }
+    }
+    for (const auto &resource : command.writes) {
+      auto writer = lastWriter.find(resource);
+      if (writer != lastWriter.end()) {
+        waitFor.push_back(writer->second);
+      }
+      for (int reader : readersSinceWrite[resource]) {
+        waitFor.push_back(reader);
+      }
+    }
+
+    for (const auto &resource : command.reads) {
+      readersSinceWrite[resource].push_back(index);
+    }
+    for (const auto &resource : command.writes) {
+      lastWriter[resource] = index;
+      readersSinceWrite[resource].clear();
+    }
+
+    std::sort(waitFor.begin(), waitFor.end());
+    waitFor.erase(std::unique(waitFor.begin(), waitFor.end()), waitFor.end());
+    for (int predecessor : waitFor) {
+      if (predecessor != index) {
+        commands[predecessor].successors.push_back(index);
+        command.dependencies++;
+      }
+    }
+  }
+}
+
+// Runs a command script on the thread pool. Commands start as soon as the
+// commands they depend on have finished, but their messages are printed in
+// the order of the script.
+int runScript(const std::string &scriptFile) {
+  std::ifstream script(scriptFile);
+  if (!script) {
+    std::cout << "[ERROR] Unable to open " << scriptFile << "\n";
+    return 1;
+  }
+
+  std::vector<ScriptCommand> commands;
+  std::string line;
+  while (std::getline(script, line)) {
+    std::istringstream iss(line);
+    std::string command;
+    iss >> command;
+    if (command == "q") {
+      break;
+    }
+    commands.push_back(ScriptCommand());
+    commands.back().line = line;
+    findCommandResources(commands.back());
+  }
+  buildDependencyGraph(commands);
+
+  int commandCount = static_cast<int>(commands.size());
+  std::vector<std::atomic<int>> pending(commandCount);
+  std::vector<std::string> results(commandCount);
+  std::vector<bool> finished(commandCount, false);
+  std::mutex resultMutex;
+  std::condition_variable resultReady;
+
+  TokenRegistry registry;
+  ThreadPool &pool = getThreadPool();
+
+  std::function<void(int)> run = [&](int index) {
+    std::ostringstream out;
+    runGuarded(
+        [&]() { return executeAndReport(registry, commands[index].line, out); },
+        out);
+
+    for (int successor : commands[index].successors) {
+      if (--pending[successor] == 0) {
+        pool.submit([&run, successor]() { run(successor); });
+      }
+    }
+
+    // Last use of the state of runScript(), which returns once every
+    // command has finished
+    std::lock_guard<std::mutex> lock(resultMutex);
+    results[index] = out.str();
+    finished[index] = true;
+    resultReady.notify_all();
+  };
+
+  for (int index = 0; index < commandCount; index++) {
+    pending[index] = commands[index].dependencies;
+  }
+  for (int index = 0; index < commandCount; index++) {
+    if (commands[index].dependencies == 0) {
+      pool.submit([&run, index]() { run(index); });
+    }
+  }
+
+  for (int index = 0; index < commandCount; index++) {
+    std::unique_lock<std::mutex> lock(resultMutex);
+    resultReady.wait(lock, [&]() { return finished[index]; });
+    std::cout << results[index];
+    std::cout.flush();
+  }
+  importCache.printSummary(std::cout);
+  printMemorySummary(std::cout);
+  return 0;
+}
+/******************** END SCHEDULER ********************/
+
+// The tuning file lives in the cache directory of the user, as it holds
+// measurements of the machine
+std::string getDefaultTuningFile() {
+  const char *cacheHome = std::getenv("XDG_CACHE_HOME");
+  const char *home = std::getenv("HOME");
+  if (cacheHome != nullptr && cacheHome[0] != '\0') {
+    return std::string(cacheHome) + "/ImageProcessing/tuning";
+  }
+  if (home != nullptr && home[0] != '\0') {
+    return std::string(home) + "/.cache/ImageProcessing/tuning";
+  }
+  return "";
+}
+
+int main(int argc, char *argv[]) {
+  std::string daemonSocket;
+  std::string clientSocket;
+  std::string scriptFile;
+  std::string benchFile;
+  bool pipeMessages = false;
+  options.tuningFile = getDefaultTuningFile();
+
+  // Images imported from the standard input are parsed through std::cin,
+  // which is many times faster when it does not go through C stdio
+  std::ios::sync_with_stdio(false);
+
+  // A reader of an exported stream may go away early. Writes then fail with
+  // EPIPE and are reported, instead of ending the process.
+  signal(SIGPIPE, SIG_IGN);
+
+  for (int arg = 1; arg < argc; arg++) {
+    std::string option = argv[arg];
+    if (option == "--pyramid") {
+      options.usePyramid = true;
+    } else if (option == "--daemon" && arg + 1 < argc) {
+      daemonSocket = argv[++arg];
+    } else if (option == "--connect" && arg + 1 < argc) {
+      clientSocket = argv[++arg];
+    } else if (option == "--script" && arg + 1 < argc) {
+      scriptFile = argv[++arg];
+    } else if (option == "--threads" && arg + 1 < argc) {
+      options.threads = std::max(1, std::atoi(argv[++arg]));
+    } else if (option == "--cache-dir" && arg + 1 < argc) {
+      options.cacheDirectory = argv[++arg];
+    } else if (option == "--cache-size" && arg + 1 < argc) {
+      options.cacheSize = std::strtoull(argv[++arg], nullptr, 10);
+    } else if (option == "--profile") {
+      options.profile = true;
+    } else if (option == "--instrument") {
+      options.instrument = true;
+    } else if (option == "--memory-budget" && arg + 1 < argc) {
+      options.memoryBudget = std::strtoull(argv[++arg], nullptr, 10);
+    } else if (option == "--calibrate") {
+      options.calibrate = true;
+    } else if (option == "--tuning" && arg + 1 < argc) {
+      options.tuningFile = argv[++arg];
+    } else if (option == "--pipe") {
+      pipeMessages = true;
+    } else if (option == "--proxy" && arg + 1 < argc) {
+      options.proxySize = std::max(0, std::atoi(argv[++arg]));
+    } else if (option == "--bench-filter" && arg + 1 < argc) {
+      benchFile = argv[++arg];
+    } else {
+      std::cout << "[ERROR] Unknown option " << option << "\n";
+      return 1;
+    }
+  }
+  if (pipeMessages) {
+    // The standard output is left to the images exported to "-"
+    std::cout.rdbuf(std::cerr.rdbuf());
+  }
+
+  if (!options.cacheDirectory.empty() &&
+      !resultCache.open(options.cacheDirectory,
+                        options.cacheSize * 1024 * 1024)) {
+    std::cout << "[ERROR] Unable to use cache directory "
+              << options.cacheDirectory << "\n";
+    return 1;
+  }
+
+  setThreadCount(options.threads);
+  // Before anything starts the thread pool, whose threads start counting
+  // when they do
+  if (options.profile && !Profiler::enable()) {
+    std::cout << "[ERROR] Performance counters are not available\n";
+    return 1;
+  }
+  if (!options.tuningFile.empty()) {
+    loadTuning(options.tuningFile);
+  }
+  if (options.calibrate) {
+    calibrate(std::cout);
+    std::error_code error;
+    std::filesystem::create_directories(
+        std::filesystem::path(options.tuningFile).parent_path(), error);
+    if (options.tuningFile.empty() || !saveTuning(options.tuningFile)) {
+      std::cout << "[ERROR] Unable to save the tunings\n";
+    } else {
+      std::cout << "[OK] Tunings saved to " << options.tuningFile << "\n";
+    }
+  }
+  memoryStats.enabled = options.instrument;
+  if (!benchFile.empty()) {
+    return runFilterBenchmark(benchFile);
+  }
+  if (!clientSocket.empty()) {
+    return runClient(clientSocket);
+  }
+  if (!daemonSocket.empty()) {
+    return runDaemon(daemonSocket);
+  }
+  if (!scriptFile.empty()) {
+    return runScript(scriptFile);
+  }
+
+  TokenRegistry registry;
+  std::string line;
+  while (std::getline(std::cin, line)) {
+    if (!runGuarded(
+            [&]() { return executeAndReport(registry, line, std::cout); },
+            std::cout)) {
+      break;
+    }
+  }
+  return 0;
+}